@@ -0,0 +1,122 @@
+#include "Routers.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Pushes packets from a user behind one full cone router to a user behind
+// another and reports packets/sec for each socket backend. Each round spawns
+// a window of concurrent sends and waits for all of them to arrive.
+
+using namespace boost::asio;
+using namespace Tests;
+
+namespace
+{
+    struct Result
+    {
+        std::size_t received = 0;
+        std::chrono::steady_clock::duration elapsed{};
+    };
+
+    // Completion handler that lets a failed coroutine out through
+    // io_context::run.
+    void rethrow(std::exception_ptr const error)
+    {
+        if (error != nullptr)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    awaitable<void> run
+    (
+        Router::Backend const backend,
+        std::size_t const rounds,
+        std::size_t const window,
+        Result& result
+    )
+    {
+        auto executor = co_await this_coro::executor;
+        auto const address1 = ip::make_address("127.0.0.2");
+        auto const address2 = ip::make_address("127.0.0.3");
+        auto const router1 = Router::create<Router::FullCone>(make_strand(executor), address1, backend);
+        auto const router2 = Router::create<Router::FullCone>(make_strand(executor), address2, backend);
+        auto const sender = router1->createUser();
+        auto const receiver = router2->createUser();
+
+        auto const mapped = static_cast<unsigned short>(10100);
+        co_await receiver.send(Router::EndPoint{ address1, mapped }, "punch");
+        auto const to = Router::EndPoint{ address2, mapped };
+        auto const payload = std::string(64, 'x');
+
+        auto const start = std::chrono::steady_clock::now();
+        for (auto round = std::size_t{ 0 }; round < rounds; ++round)
+        {
+            for (auto i = std::size_t{ 0 }; i < window; ++i)
+            {
+                co_spawn(executor, sender.send(to, payload), rethrow);
+            }
+            for (auto i = std::size_t{ 0 }; i < window; ++i)
+            {
+                co_await receiver.receive();
+                result.received += 1;
+            }
+        }
+        result.elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    auto failed = false;
+
+    void report
+    (
+        char const* const name,
+        Router::Backend const backend,
+        std::size_t const rounds,
+        std::size_t const window
+    )
+    {
+        auto result = Result{};
+        try
+        {
+            auto context = io_context{ 1 };
+            auto done = false;
+            co_spawn
+            (
+                context,
+                run(backend, rounds, window, result),
+                [&done](std::exception_ptr const error)
+                {
+                    done = true;
+                    rethrow(error);
+                }
+            );
+            // a dropped datagram would stall the last round forever
+            context.run_for(std::chrono::seconds{ 30 });
+            if (not done)
+            {
+                std::cout << name << ": timed out after " << result.received << " packets\n";
+                failed = true;
+                return;
+            }
+        }
+        catch (std::exception const& error)
+        {
+            std::cout << name << ": " << error.what() << '\n';
+            failed = true;
+            return;
+        }
+        auto const seconds = std::chrono::duration<double>(result.elapsed).count();
+        std::cout << name << ": " << result.received << " packets in " << seconds << " s, ";
+        std::cout << (seconds > 0 ? result.received / seconds : 0) << " packets/sec\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    auto const rounds = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000;
+    auto const window = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 32;
+    report("reactor", Router::Backend::Reactor, rounds, window);
+    report("io_uring", Router::Backend::Uring, rounds, window);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
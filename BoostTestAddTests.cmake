@@ -0,0 +1,129 @@
+# Distributed under the OSI-approved BSD 3-Clause License.  See accompanying
+# file Copyright.txt or https://cmake.org/licensing for details.
+
+# Companion script of BoostTest.cmake; runs the test executable at build time,
+# parses the output of --list_content and writes one add_test() per test case.
+
+set(script)
+set(tests)
+
+function(add_command NAME)
+  set(_args "")
+  foreach(_arg ${ARGN})
+    if(_arg MATCHES "[^-./:a-zA-Z0-9_]")
+      set(_args "${_args} [==[${_arg}]==]")
+    else()
+      set(_args "${_args} ${_arg}")
+    endif()
+  endforeach()
+  set(script "${script}${NAME}(${_args})\n" PARENT_SCOPE)
+endfunction()
+
+if(NOT EXISTS "${TEST_EXECUTABLE}")
+  message(FATAL_ERROR
+    "Specified test executable does not exist.\n"
+    "  Path: '${TEST_EXECUTABLE}'"
+  )
+endif()
+
+execute_process(
+  COMMAND ${TEST_EXECUTOR} "${TEST_EXECUTABLE}" --list_content
+  WORKING_DIRECTORY "${TEST_WORKING_DIR}"
+  TIMEOUT ${TEST_DISCOVERY_TIMEOUT}
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output
+  RESULT_VARIABLE result
+)
+if(NOT ${result} EQUAL 0)
+  string(REPLACE "\n" "\n    " output "${output}")
+  message(FATAL_ERROR
+    "Error running test executable.\n"
+    "  Path: '${TEST_EXECUTABLE}'\n"
+    "  Result: ${result}\n"
+    "  Output:\n"
+    "    ${output}\n"
+  )
+endif()
+
+# --list_content prints one unit per line, indented by four spaces per level,
+# with a trailing '*' on units that are enabled by default. A unit followed by
+# a deeper line is a suite and becomes part of the path of the units below it.
+string(REPLACE ";" "\\;" output "${output}")
+string(REPLACE "\n" ";" output "${output}")
+set(levels)
+set(names)
+set(flags)
+foreach(line ${output})
+  if(line MATCHES "^( *)([^ *]+)(\\*?) *$")
+    string(LENGTH "${CMAKE_MATCH_1}" indent)
+    math(EXPR level "${indent} / 4")
+    list(APPEND levels ${level})
+    list(APPEND names "${CMAKE_MATCH_2}")
+    if(CMAKE_MATCH_3 STREQUAL "*")
+      list(APPEND flags 1)
+    else()
+      list(APPEND flags 0)
+    endif()
+  endif()
+endforeach()
+
+set(tests_found)
+set(tests_enabled)
+set(path)
+list(LENGTH names count)
+set(index 0)
+while(index LESS count)
+  list(GET levels ${index} level)
+  list(GET names ${index} name)
+  list(GET flags ${index} enabled)
+  math(EXPR next "${index} + 1")
+  set(next_level -1)
+  if(next LESS count)
+    list(GET levels ${next} next_level)
+  endif()
+
+  list(LENGTH path depth)
+  while(depth GREATER level)
+    list(REMOVE_AT path -1)
+    list(LENGTH path depth)
+  endwhile()
+
+  if(next_level GREATER level)
+    list(APPEND path "${name}")
+  else()
+    set(full ${path} ${name})
+    string(REPLACE ";" "/" full "${full}")
+    list(APPEND tests_found "${full}")
+    list(APPEND tests_enabled ${enabled})
+  endif()
+  set(index ${next})
+endwhile()
+
+set(index 0)
+foreach(test ${tests_found})
+  list(GET tests_enabled ${index} enabled)
+  math(EXPR index "${index} + 1")
+  string(REPLACE "/" "." ctest_name "${test}")
+  set(ctest_name "${TEST_PREFIX}${ctest_name}${TEST_SUFFIX}")
+  add_command(add_test
+    "${ctest_name}"
+    ${TEST_EXECUTOR}
+    "${TEST_EXECUTABLE}"
+    "--run_test=${test}"
+    ${TEST_EXTRA_ARGS}
+  )
+  add_command(set_tests_properties
+    "${ctest_name}"
+    PROPERTIES
+    WORKING_DIRECTORY "${TEST_WORKING_DIR}"
+    ${TEST_PROPERTIES}
+  )
+  if(NOT enabled)
+    add_command(set_tests_properties "${ctest_name}" PROPERTIES DISABLED TRUE)
+  endif()
+  list(APPEND tests "${ctest_name}")
+endforeach()
+
+add_command(set ${TEST_LIST} ${tests})
+
+file(WRITE "${CTEST_FILE}" "${script}")
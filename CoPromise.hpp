@@ -0,0 +1,586 @@
+#pragma once
+#include <utility>
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+namespace Tests
+{
+    // A coroutine parked on a CoPromise, a CoEvent or anything else with a
+    // push(waiter) member. The node is owned by the object the caller awaits
+    // on, or by the caller's own frame, and is linked intrusively into the
+    // queue, so parking and waking never touch the heap.
+    //
+    // Parking goes through the public async_initiate with use_awaitable: the
+    // completion handler, which owns the suspended coroutine, is kept inline
+    // in the node until it is completed with Args. The only frame involved
+    // is the one async_initiate itself creates, which asio recycles through
+    // its single per-thread cache. Needs Boost 1.74 or newer.
+    template<typename... Args>
+    class BasicCoWaiter
+    {
+    public:
+        using Executor = boost::asio::any_io_executor;
+
+    private:
+        enum class Completion
+        {
+            Invoke,
+            Post,
+            Destroy,
+        };
+        using Arguments = std::tuple<Args...>;
+
+        // use_awaitable's handler is an executor and a frame pointer
+        static constexpr std::size_t handlerSize = 16 * sizeof(void*);
+
+        std::aligned_storage_t<handlerSize, alignof(std::max_align_t)> m_handler;
+        void (*m_complete)(void* handler, Completion const how, Arguments* arguments) = nullptr;
+        BasicCoWaiter* m_next = nullptr;
+
+    public:
+        BasicCoWaiter() = default;
+        BasicCoWaiter(BasicCoWaiter&& other) noexcept
+        {
+            if (other.isParked())
+            {
+                std::terminate();
+            }
+        }
+        BasicCoWaiter& operator=(BasicCoWaiter&&) = delete;
+
+        ~BasicCoWaiter()
+        {
+            abandon();
+        }
+
+        // async_initiate initiation; asio runs it once the awaiting coroutine
+        // is suspended, so the queue never sees a waiter that is still
+        // running.
+        template<typename Queue>
+        class Park
+        {
+        private:
+            BasicCoWaiter* m_waiter;
+            Queue* m_queue;
+
+        public:
+            Park(BasicCoWaiter& waiter, Queue& queue) :
+                m_waiter{ &waiter },
+                m_queue{ &queue }
+            {}
+
+            template<typename Handler>
+            void operator()(Handler&& handler) const
+            {
+                m_waiter->store(std::forward<Handler>(handler));
+                m_queue->push(*m_waiter);
+            }
+        };
+
+        // Use as `co_await waiter.park(queue);` from an asio awaitable; the
+        // result is Args the way use_awaitable maps them, so a leading
+        // exception_ptr is rethrown. The waiter and the queue must outlive
+        // the suspension.
+        template<typename Queue>
+        auto park(Queue& queue)
+        {
+            return boost::asio::async_initiate<boost::asio::use_awaitable_t<> const&, void(Args...)>
+            (
+                Park<Queue>{ *this, queue },
+                boost::asio::use_awaitable
+            );
+        }
+
+        bool isParked() const noexcept
+        {
+            return m_complete != nullptr;
+        }
+
+        // Resumes the parked coroutine inline, on the calling thread. The
+        // handler is moved onto this stack frame first because the node may
+        // die with the coroutine it resumes.
+        void resume(Args... args)
+        {
+            auto arguments = Arguments{ std::move(args)... };
+            take()(&m_handler, Completion::Invoke, &arguments);
+        }
+
+        // Resumes the parked coroutine through its own executor. The node is
+        // free again as soon as this returns.
+        void post(Args... args)
+        {
+            auto arguments = Arguments{ std::move(args)... };
+            take()(&m_handler, Completion::Post, &arguments);
+        }
+
+        // Drops the parked coroutine without resuming it; its frame is
+        // unwound through its executor.
+        void abandon() noexcept
+        {
+            if (isParked())
+            {
+                std::exchange(m_complete, nullptr)(&m_handler, Completion::Destroy, nullptr);
+            }
+        }
+
+    private:
+        friend class CoWaitQueue;
+
+        auto take()
+        {
+            if (not isParked())
+            {
+                throw std::logic_error{ "waiter not parked" };
+            }
+            return std::exchange(m_complete, nullptr);
+        }
+
+        template<typename Handler>
+        void store(Handler&& handler)
+        {
+            using Stored = std::decay_t<Handler>;
+            static_assert(sizeof(Stored) <= handlerSize, "use_awaitable handler does not fit the waiter");
+            static_assert(alignof(Stored) <= alignof(std::max_align_t), "use_awaitable handler is overaligned");
+            if (isParked())
+            {
+                throw std::logic_error{ "waiter already parked" };
+            }
+
+            new (&m_handler) Stored(std::forward<Handler>(handler));
+            m_complete = [](void* const stored, Completion const how, Arguments* const arguments)
+            {
+                auto& parked = *std::launder(static_cast<Stored*>(stored));
+                auto handler = std::move(parked);
+                parked.~Stored();
+                switch (how)
+                {
+                case Completion::Invoke:
+                    std::apply(std::move(handler), std::move(*arguments));
+                    break;
+                case Completion::Post:
+                {
+                    auto const executor = boost::asio::get_associated_executor(handler);
+                    boost::asio::post
+                    (
+                        executor,
+                        [handler = std::move(handler), arguments = std::move(*arguments)]() mutable
+                        {
+                            std::apply(std::move(handler), std::move(arguments));
+                        }
+                    );
+                    break;
+                }
+                case Completion::Destroy:
+                    break;
+                }
+            };
+        }
+    };
+
+    using CoWaiter = BasicCoWaiter<>;
+
+    // FIFO of parked waiters, linked through the waiters themselves.
+    class CoWaitQueue
+    {
+    private:
+        CoWaiter* m_head = nullptr;
+        CoWaiter** m_tail = &m_head;
+
+    public:
+        CoWaitQueue() = default;
+        CoWaitQueue(CoWaitQueue&& other) noexcept :
+            m_head{ std::exchange(other.m_head, nullptr) },
+            m_tail{ m_head == nullptr ? &m_head : std::exchange(other.m_tail, &other.m_head) }
+        {}
+        CoWaitQueue& operator=(CoWaitQueue&&) = delete;
+
+        ~CoWaitQueue()
+        {
+            abandonAll();
+        }
+
+        bool empty() const noexcept
+        {
+            return m_head == nullptr;
+        }
+
+        void push(CoWaiter& waiter) noexcept
+        {
+            waiter.m_next = nullptr;
+            *m_tail = &waiter;
+            m_tail = &waiter.m_next;
+        }
+
+        CoWaiter* pop() noexcept
+        {
+            auto const waiter = m_head;
+            if (waiter != nullptr)
+            {
+                m_head = std::exchange(waiter->m_next, nullptr);
+                if (m_head == nullptr)
+                {
+                    m_tail = &m_head;
+                }
+            }
+            return waiter;
+        }
+
+        // Wakes every waiter currently queued with a single post to executor,
+        // which resumes them inline one after the other. They must have
+        // parked from code running on that executor.
+        template<typename Executor>
+        void resumeAll(Executor const& executor)
+        {
+            if (empty())
+            {
+                return;
+            }
+            boost::asio::post
+            (
+                executor,
+                [head = takeAll()]() mutable
+                {
+                    while (head != nullptr)
+                    {
+                        std::exchange(head, std::exchange(head->m_next, nullptr))->resume();
+                    }
+                }
+            );
+        }
+
+        // Unlinks every waiter before dropping them, so an abandoned frame
+        // that owns this queue can destroy it on the way out.
+        void abandonAll() noexcept
+        {
+            auto head = takeAll();
+            while (head != nullptr)
+            {
+                std::exchange(head, std::exchange(head->m_next, nullptr))->abandon();
+            }
+        }
+
+    private:
+        CoWaiter* takeAll() noexcept
+        {
+            m_tail = &m_head;
+            return std::exchange(m_head, nullptr);
+        }
+    };
+
+    // Moves the calling coroutine onto executor: it carries on there, inline,
+    // until its next suspension, and later completions go back to its own
+    // executor as usual. Unlike co_spawn this needs no new coroutine, so it
+    // costs one post.
+    template<typename Executor>
+    auto resumeOn(Executor const& executor)
+    {
+        return boost::asio::async_initiate<boost::asio::use_awaitable_t<> const&, void()>
+        (
+            [executor](auto&& handler)
+            {
+                // wrapped, so that post does not hand it back to the
+                // coroutine's own executor
+                boost::asio::post
+                (
+                    executor,
+                    [handler = std::move(handler)]() mutable { std::move(handler)(); }
+                );
+            },
+            boost::asio::use_awaitable
+        );
+    }
+
+    // Single-shot promise. The waiter and the result live in the promise
+    // itself, so awaiting it costs no more than the async_initiate behind
+    // getAwaitable. Rejecting a promise of T needs T to be default
+    // constructible, since the exception and a value complete it together.
+    template<typename T = void>
+    class CoPromise
+    {
+    public:
+        using Value = std::conditional_t<std::is_void_v<T>, bool, T>;
+
+    private:
+        using Waiter = std::conditional_t
+        <
+            std::is_void_v<T>,
+            BasicCoWaiter<std::exception_ptr>,
+            BasicCoWaiter<std::exception_ptr, Value>
+        >;
+        friend typename Waiter::template Park<CoPromise>;
+
+        Waiter m_waiter;
+        std::optional<Value> m_value;
+        std::exception_ptr m_exception;
+        bool m_awaited = false;
+        bool m_settled = false;
+
+    public:
+        CoPromise() = default;
+        CoPromise(CoPromise const&) = delete;
+        CoPromise& operator=(CoPromise const&) = delete;
+
+        ~CoPromise()
+        {
+            if (m_waiter.isParked() and not m_settled)
+            {
+                reject(std::logic_error{ "unresolved promise" });
+            }
+        }
+
+        // Use as `co_await promise.getAwaitable();` from an asio awaitable.
+        // The promise must outlive the suspension.
+        auto getAwaitable()
+        {
+            if (std::exchange(m_awaited, true))
+            {
+                throw std::logic_error{ "copromise no state" };
+            }
+            return m_waiter.park(*this);
+        }
+
+        template<typename... Args>
+        void resolve(Args&&... args)
+        {
+            if constexpr (std::is_void_v<T>)
+            {
+                static_assert(sizeof...(Args) == 0, "void promise takes no value");
+                settle([this] { m_value.emplace(true); });
+            }
+            else
+            {
+                settle([&] { m_value.emplace(std::forward<Args>(args)...); });
+            }
+        }
+
+        void reject(std::exception_ptr const& exception)
+        {
+            settle([&] { m_exception = exception; });
+        }
+
+        template<typename E, typename = std::enable_if_t<std::is_base_of_v<std::exception, E>>>
+        void reject(E const& exception)
+        {
+            reject(std::make_exception_ptr(exception));
+        }
+
+        bool isSettled() const noexcept
+        {
+            return m_settled;
+        }
+
+    private:
+        // Queue side of Waiter::Park; a promise settled before it was awaited
+        // completes straight away.
+        void push(Waiter&)
+        {
+            if (m_settled)
+            {
+                complete();
+            }
+        }
+
+        template<typename Setter>
+        void settle(Setter&& setter)
+        {
+            if (m_settled)
+            {
+                throw std::logic_error{ "promise already settled" };
+            }
+            setter();
+            m_settled = true;
+            if (m_waiter.isParked())
+            {
+                complete();
+            }
+        }
+
+        // The result travels with the posted completion, so the promise may
+        // be gone by the time the awaiting coroutine runs.
+        void complete()
+        {
+            if constexpr (std::is_void_v<T>)
+            {
+                m_waiter.post(std::exchange(m_exception, nullptr));
+            }
+            else
+            {
+                auto value = m_value.has_value() ? std::move(*m_value) : Value{};
+                m_waiter.post(std::exchange(m_exception, nullptr), std::move(value));
+            }
+        }
+    };
+
+    // Abandons the waiters of every registered object when their execution
+    // context shuts down. A parked coroutine is owned by what it waits on, so
+    // a waiter whose frame in turn owns that object, say through a
+    // shared_ptr, would otherwise keep both alive after the context is gone.
+    class CoWaitService final : public boost::asio::execution_context::service
+    {
+    public:
+        static inline boost::asio::execution_context::id id;
+
+        class Registration
+        {
+        private:
+            friend class CoWaitService;
+
+            CoWaitService* m_service;
+            Registration* m_previous = nullptr;
+            Registration* m_next = nullptr;
+
+        protected:
+            template<typename Executor>
+            explicit Registration(Executor const& executor) :
+                m_service
+                {
+                    &boost::asio::use_service<CoWaitService>
+                    (
+                        boost::asio::query(executor, boost::asio::execution::context)
+                    )
+                }
+            {
+                m_service->add(*this);
+            }
+
+            Registration(Registration const& other) :
+                m_service{ other.m_service }
+            {
+                if (m_service != nullptr)
+                {
+                    m_service->add(*this);
+                }
+            }
+            Registration& operator=(Registration const&) = delete;
+
+            ~Registration()
+            {
+                if (m_service != nullptr)
+                {
+                    m_service->remove(*this);
+                }
+            }
+
+            // Runs once, on the thread destroying the context, after this has
+            // been unregistered. Abandoned frames may destroy this object.
+            virtual void abandonAll() noexcept = 0;
+        };
+
+        explicit CoWaitService(boost::asio::execution_context& context) :
+            service{ context }
+        {}
+
+    private:
+        std::mutex m_mutex;
+        Registration* m_head = nullptr;
+
+        void add(Registration& registration)
+        {
+            auto const lock = std::lock_guard{ m_mutex };
+            registration.m_next = m_head;
+            if (m_head != nullptr)
+            {
+                m_head->m_previous = &registration;
+            }
+            m_head = &registration;
+        }
+
+        void remove(Registration& registration)
+        {
+            auto const lock = std::lock_guard{ m_mutex };
+            unlink(registration);
+        }
+
+        void unlink(Registration& registration) noexcept
+        {
+            if (registration.m_previous != nullptr)
+            {
+                registration.m_previous->m_next = registration.m_next;
+            }
+            else
+            {
+                m_head = registration.m_next;
+            }
+            if (registration.m_next != nullptr)
+            {
+                registration.m_next->m_previous = registration.m_previous;
+            }
+            registration.m_previous = nullptr;
+            registration.m_next = nullptr;
+            registration.m_service = nullptr;
+        }
+
+        // Registered after the scheduler and the strands of the objects it
+        // watches, so this runs while abandoned frames can still be posted
+        // for unwinding.
+        void shutdown() override
+        {
+            while (true)
+            {
+                auto lock = std::unique_lock{ m_mutex };
+                auto const registration = m_head;
+                if (registration == nullptr)
+                {
+                    return;
+                }
+                unlink(*registration);
+                lock.unlock();
+                registration->abandonAll();
+            }
+        }
+    };
+
+    // Multi-waiter event in the style of a condition variable: wait parks the
+    // caller until the next notifyAll, and callers re-check their own state
+    // after waking. All waiters of one notification are resumed from a single
+    // post to the event's executor, usually the owning strand, so they have
+    // to wait from code running on it. Waiters still parked when the
+    // executor's context shuts down are abandoned.
+    class CoEvent : private CoWaitService::Registration
+    {
+    public:
+        using Executor = CoWaiter::Executor;
+
+    private:
+        Executor m_executor;
+        CoWaitQueue m_queue;
+
+    public:
+        explicit CoEvent(Executor executor) :
+            Registration{ executor },
+            m_executor{ std::move(executor) }
+        {}
+
+        CoEvent(CoEvent&&) = default;
+
+        // Use as `co_await event.wait(waiter);` from an asio awaitable, with
+        // the waiter in the caller's frame.
+        auto wait(CoWaiter& waiter)
+        {
+            return waiter.park(m_queue);
+        }
+
+        bool hasWaiters() const noexcept
+        {
+            return not m_queue.empty();
+        }
+
+        void notifyAll()
+        {
+            m_queue.resumeAll(m_executor);
+        }
+
+    private:
+        void abandonAll() noexcept override
+        {
+            m_queue.abandonAll();
+        }
+    };
+}
@@ -0,0 +1,759 @@
+#include "Routers.hpp"
+#include "TestSupport.hpp"
+#include <boost/test/unit_test.hpp>
+#include <boost/test/data/monomorphic.hpp>
+#include <boost/test/data/test_case.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// NAT conformance matrix. Every policy makeNat<> knows is run through the
+// same scenarios with both allocators, and against every other policy for
+// traversal. Each case gets its own io_context and its own 127.S.L.0/24
+// (S for the scenario, L for the case), so CTest can run them all in
+// parallel. The Stress suite drives bare NAT tables, since a router would
+// need a socket per mapping.
+
+using namespace boost::asio;
+using namespace Tests;
+namespace data = boost::unit_test::data;
+
+namespace
+{
+    using EndPoint = Router::EndPoint;
+    using Address = Router::Address;
+    using Allocation = Router::Allocation;
+
+    // How a policy maps and filters, in RFC 4787 terms.
+    enum class Mapping
+    {
+        None,
+        EndpointIndependent,
+        EndpointDependent,
+    };
+
+    enum class Filtering
+    {
+        None,
+        AddressDependent,
+        PortDependent,
+    };
+
+    struct Policy
+    {
+        char const* name;
+        Mapping mapping;
+        Filtering filtering;
+        std::shared_ptr<Router> (*create)(Router::Strand, Address const&, Allocation);
+        std::unique_ptr<Router::Nat> (*makeNat)(Allocation);
+    };
+
+    template<typename T>
+    Policy makePolicy(char const* const name, Mapping const mapping, Filtering const filtering)
+    {
+        return Policy
+        {
+            name,
+            mapping,
+            filtering,
+            [](Router::Strand strand, Address const& address, Allocation const allocation)
+            {
+                return Router::create<T>(std::move(strand), address, Router::Backend::Reactor, allocation);
+            },
+            [](Allocation const allocation)
+            {
+                return Router::makeNat<T>(allocation);
+            },
+        };
+    }
+
+    std::vector<Policy> const& getPolicies()
+    {
+        static auto const policies = std::vector<Policy>
+        {
+            makePolicy<Router::NoNat>("NoNat", Mapping::None, Filtering::None),
+            makePolicy<Router::FullCone>("FullCone", Mapping::EndpointIndependent, Filtering::None),
+            makePolicy<Router::AddressRestricted>("AddressRestricted", Mapping::EndpointIndependent, Filtering::AddressDependent),
+            makePolicy<Router::PortRestricted>("PortRestricted", Mapping::EndpointIndependent, Filtering::PortDependent),
+            // each mapping only answers the endpoint it was made for
+            makePolicy<Router::Symmetric>("Symmetric", Mapping::EndpointDependent, Filtering::PortDependent),
+        };
+        return policies;
+    }
+
+    struct NatCase
+    {
+        Policy policy;
+        Allocation allocation;
+        int lane;
+    };
+
+    struct PeerCase
+    {
+        Policy local;
+        Policy remote;
+        int lane;
+    };
+
+    std::ostream& operator<<(std::ostream& out, NatCase const& natCase)
+    {
+        auto const allocation = natCase.allocation == Allocation::PortBlock ? "PortBlock" : "Sequential";
+        return out << natCase.policy.name << '/' << allocation;
+    }
+
+    std::ostream& operator<<(std::ostream& out, PeerCase const& peerCase)
+    {
+        return out << peerCase.local.name << " to " << peerCase.remote.name;
+    }
+
+    std::vector<NatCase> getNatCases(bool const translating, std::vector<Allocation> const& allocations)
+    {
+        auto cases = std::vector<NatCase>{};
+        for (auto const& policy : getPolicies())
+        {
+            if (translating and policy.mapping == Mapping::None)
+            {
+                continue;
+            }
+            for (auto const allocation : allocations)
+            {
+                cases.push_back(NatCase{ policy, allocation, static_cast<int>(cases.size()) });
+            }
+        }
+        return cases;
+    }
+
+    std::vector<NatCase> getNatCases(bool const translating)
+    {
+        return getNatCases(translating, { Allocation::Sequential, Allocation::PortBlock });
+    }
+
+    std::vector<PeerCase> getPeerCases()
+    {
+        auto cases = std::vector<PeerCase>{};
+        for (auto const& local : getPolicies())
+        {
+            for (auto const& remote : getPolicies())
+            {
+                cases.push_back(PeerCase{ local, remote, static_cast<int>(cases.size()) });
+            }
+        }
+        return cases;
+    }
+
+    // NoNat binds the user ids themselves, which are privileged ports.
+    bool needsPrivilege(NatCase const& natCase)
+    {
+        return natCase.policy.mapping == Mapping::None;
+    }
+
+    bool needsPrivilege(PeerCase const& peerCase)
+    {
+        return peerCase.local.mapping == Mapping::None or peerCase.remote.mapping == Mapping::None;
+    }
+
+    // A precondition for a data test case over cases: samples that need a
+    // privileged port are skipped, rather than passed, where binding one is
+    // denied. Boost names the generated cases _0, _1, ... after the sample.
+    template<typename Case>
+    auto privileged(std::vector<Case> cases)
+    {
+        return [cases = std::move(cases)](boost::unit_test::test_unit_id const id)
+        {
+            auto const& name = boost::unit_test::framework::get(id, boost::unit_test::TUT_CASE).p_name.get();
+            if (not needsPrivilege(cases.at(std::stoul(name.substr(1)))))
+            {
+                return boost::test_tools::assertion_result{ true };
+            }
+            auto context = io_context{};
+            auto socket = ip::udp::socket{ context, ip::udp::v4() };
+            auto error = boost::system::error_code{};
+            socket.bind(EndPoint{ ip::address_v4::loopback(), 1 }, error);
+            if (error == boost::asio::error::access_denied)
+            {
+                auto result = boost::test_tools::assertion_result{ false };
+                result.message() << "cannot bind a privileged port: " << error.message();
+                return result;
+            }
+            return boost::test_tools::assertion_result{ true };
+        };
+    }
+
+    Address makeAddress(int const scenario, int const lane, int const host)
+    {
+        return ip::address_v4{ ip::address_v4::bytes_type
+        {
+            127,
+            static_cast<unsigned char>(scenario),
+            static_cast<unsigned char>(lane),
+            static_cast<unsigned char>(host),
+        } };
+    }
+
+    Router::Socket makePeer(any_io_executor executor, Address const& address)
+    {
+        auto peer = Router::Socket{ executor };
+        peer.open(ip::udp::v4());
+        peer.bind(EndPoint{ address, 0 });
+        return peer;
+    }
+
+    // Receives one datagram on a plain socket and returns its source.
+    awaitable<EndPoint> receiveFrom(Router::Socket& peer)
+    {
+        auto buffer = std::array<char, 64>{};
+        auto from = EndPoint{};
+        co_await peer.async_receive_from(boost::asio::buffer(buffer), from);
+        co_return from;
+    }
+
+    // Waits until the router has decided on arrivals inbound datagrams,
+    // delivered or filtered.
+    awaitable<void> settle(Router const& router, std::size_t const arrivals)
+    {
+        auto timer = steady_timer{ co_await this_coro::executor };
+        while (true)
+        {
+            auto const statistics = router.getStatistics();
+            if (statistics.delivered + statistics.filtered >= arrivals)
+            {
+                co_return;
+            }
+            timer.expires_after(std::chrono::milliseconds{ 1 });
+            co_await timer.async_wait(use_awaitable);
+        }
+    }
+
+    std::size_t expectedMappings(Policy const& policy, std::size_t const destinations)
+    {
+        switch (policy.mapping)
+        {
+        case Mapping::None: return 0;
+        case Mapping::EndpointIndependent: return 1;
+        case Mapping::EndpointDependent: return destinations;
+        }
+        return 0;
+    }
+
+    // Three destinations: two ports on one address and one on another.
+    // Endpoint-independent mapping shows all of them the same public
+    // endpoint and reuses it; endpoint-dependent mapping shows each its own.
+    awaitable<void> testMapping(NatCase const natCase)
+    {
+        auto executor = co_await this_coro::executor;
+        auto const router = natCase.policy.create
+        (
+            make_strand(executor),
+            makeAddress(20, natCase.lane, 1),
+            natCase.allocation
+        );
+        auto const user = router->createUser();
+        auto peers = std::vector<Router::Socket>{};
+        peers.push_back(makePeer(executor, makeAddress(20, natCase.lane, 2)));
+        peers.push_back(makePeer(executor, makeAddress(20, natCase.lane, 2)));
+        peers.push_back(makePeer(executor, makeAddress(20, natCase.lane, 3)));
+
+        auto seen = std::vector<EndPoint>{};
+        for (auto& peer : peers)
+        {
+            co_await user.send(peer.local_endpoint(), "mapping");
+            seen.push_back(co_await receiveFrom(peer));
+            BOOST_CHECK(seen.back().address() == makeAddress(20, natCase.lane, 1));
+        }
+        co_await user.send(peers.front().local_endpoint(), "reuse");
+        BOOST_CHECK(co_await receiveFrom(peers.front()) == seen.front());
+
+        auto const distinct = std::set<EndPoint>(cbegin(seen), cend(seen)).size();
+        BOOST_CHECK_EQUAL(distinct, std::size_t{ natCase.policy.mapping == Mapping::EndpointDependent ? 3u : 1u });
+        BOOST_CHECK_EQUAL(router->getStatistics().mappings, expectedMappings(natCase.policy, peers.size()));
+    }
+
+    // After the user talks to one peer, that peer, another port on its
+    // address and another address all aim at the mapping. What gets
+    // through depends only on the filtering behaviour.
+    awaitable<void> testFiltering(NatCase const natCase)
+    {
+        auto executor = co_await this_coro::executor;
+        auto const router = natCase.policy.create
+        (
+            make_strand(executor),
+            makeAddress(21, natCase.lane, 1),
+            natCase.allocation
+        );
+        auto const user = router->createUser();
+        auto contacted = makePeer(executor, makeAddress(21, natCase.lane, 2));
+        auto samePeerAddress = makePeer(executor, makeAddress(21, natCase.lane, 2));
+        auto otherAddress = makePeer(executor, makeAddress(21, natCase.lane, 3));
+
+        co_await user.send(contacted.local_endpoint(), "open");
+        auto const mapped = co_await receiveFrom(contacted);
+
+        co_await otherAddress.async_send_to(buffer(std::string_view{ "other address" }), mapped);
+        co_await samePeerAddress.async_send_to(buffer(std::string_view{ "same address" }), mapped);
+        co_await contacted.async_send_to(buffer(std::string_view{ "contacted" }), mapped);
+        co_await settle(*router, 3);
+
+        auto expected = std::set<std::string>{ "contacted" };
+        if (natCase.policy.filtering != Filtering::PortDependent)
+        {
+            expected.insert("same address");
+        }
+        if (natCase.policy.filtering == Filtering::None)
+        {
+            expected.insert("other address");
+        }
+        auto const statistics = router->getStatistics();
+        BOOST_CHECK_EQUAL(statistics.delivered, expected.size());
+        BOOST_CHECK_EQUAL(statistics.filtered, 3 - expected.size());
+
+        auto received = std::set<std::string>{};
+        for (auto i = std::size_t{ 0 }; i < statistics.delivered; ++i)
+        {
+            auto [from, data] = co_await user.receive();
+            received.insert(data);
+        }
+        BOOST_CHECK(received == expected);
+
+        // sending to a peer opens the filter for it
+        co_await user.send(otherAddress.local_endpoint(), "open");
+        auto const mappedOther = co_await receiveFrom(otherAddress);
+        co_await otherAddress.async_send_to(buffer(std::string_view{ "reply" }), mappedOther);
+        auto [from, data] = co_await user.receive();
+        BOOST_CHECK_EQUAL(data, "reply");
+        BOOST_CHECK(from == otherAddress.local_endpoint());
+    }
+
+    // Hole punching through two NATs: both users register with a
+    // rendezvous socket, learn each other's public endpoint from it, and
+    // then alternate sends at that endpoint.
+    awaitable<void> testTraversal(PeerCase const peerCase)
+    {
+        auto executor = co_await this_coro::executor;
+        auto const routerA = peerCase.local.create
+        (
+            make_strand(executor),
+            makeAddress(22, peerCase.lane, 1),
+            Allocation::Sequential
+        );
+        auto const routerB = peerCase.remote.create
+        (
+            make_strand(executor),
+            makeAddress(22, peerCase.lane, 2),
+            Allocation::Sequential
+        );
+        auto rendezvous = makePeer(executor, makeAddress(22, peerCase.lane, 3));
+        auto const userA = routerA->createUser();
+        auto const userB = routerB->createUser();
+
+        co_await userA.send(rendezvous.local_endpoint(), "register");
+        auto const publicA = co_await receiveFrom(rendezvous);
+        co_await userB.send(rendezvous.local_endpoint(), "register");
+        auto const publicB = co_await receiveFrom(rendezvous);
+
+        co_await userA.send(publicB, "a1");
+        co_await settle(*routerB, 1);
+        co_await userB.send(publicA, "b1");
+        co_await settle(*routerA, 1);
+        co_await userA.send(publicB, "a2");
+        co_await settle(*routerB, 2);
+        co_await userB.send(publicA, "b2");
+        co_await settle(*routerA, 2);
+
+        // The first punch only passes an unfiltered NAT. Later ones pass a
+        // port filter only if they come from the mapping it punched toward,
+        // and only if they arrive at the mapping that did the punching,
+        // which for a symmetric NAT is not the one the rendezvous saw.
+        auto const local = peerCase.local;
+        auto const remote = peerCase.remote;
+        auto const portFiltered = [](Policy const& receiver, Policy const& sender)
+        {
+            return receiver.filtering == Filtering::PortDependent
+                and (sender.mapping == Mapping::EndpointDependent or receiver.mapping == Mapping::EndpointDependent);
+        };
+        auto const toB = std::size_t{ remote.filtering == Filtering::None } + std::size_t{ not portFiltered(remote, local) };
+        auto const toA = 2 * std::size_t{ not portFiltered(local, remote) };
+        BOOST_CHECK_EQUAL(routerB->getStatistics().delivered, toB);
+        BOOST_CHECK_EQUAL(routerA->getStatistics().delivered, toA);
+        BOOST_CHECK_EQUAL(routerA->getStatistics().mappings, expectedMappings(local, 2));
+        BOOST_CHECK_EQUAL(routerB->getStatistics().mappings, expectedMappings(remote, 2));
+        BOOST_TEST_MESSAGE(peerCase << (toA > 0 and toB > 0 ? ": connected" : ": no path"));
+
+        for (auto i = std::size_t{ 0 }; i < toB; ++i)
+        {
+            auto [from, data] = co_await userB.receive();
+            BOOST_CHECK(from.address() == makeAddress(22, peerCase.lane, 1));
+        }
+        for (auto i = std::size_t{ 0 }; i < toA; ++i)
+        {
+            auto [from, data] = co_await userA.receive();
+            BOOST_CHECK(from.address() == makeAddress(22, peerCase.lane, 2));
+        }
+    }
+
+    // Sequential allocation runs dry after 401 mappings. The failing send
+    // throws out of User::send and leaves the existing mappings working.
+    awaitable<void> testRouterExhaustion(NatCase const natCase)
+    {
+        constexpr auto capacity = std::size_t{ 401 };
+        auto executor = co_await this_coro::executor;
+        auto const router = natCase.policy.create
+        (
+            make_strand(executor),
+            makeAddress(23, natCase.lane, 1),
+            natCase.allocation
+        );
+        auto sink = makePeer(executor, makeAddress(23, natCase.lane, 2));
+        auto const dependent = natCase.policy.mapping == Mapping::EndpointDependent;
+
+        // Symmetric mappings fill up with unbound ports on the sink's
+        // address; cone mappings with one user each. Whatever reaches the
+        // sink is read straight away so its receive buffer cannot overflow.
+        auto users = std::vector<Router::User>{ router->createUser() };
+        auto const send = [&](std::size_t const index) -> awaitable<void>
+        {
+            auto to = sink.local_endpoint();
+            if (dependent and index > 0)
+            {
+                to.port(static_cast<unsigned short>(20000 + index));
+            }
+            else if (not dependent and index > 0)
+            {
+                users.push_back(router->createUser());
+            }
+            co_await users.back().send(to, "fill");
+            if (to == sink.local_endpoint())
+            {
+                co_await receiveFrom(sink);
+            }
+        };
+
+        for (auto i = std::size_t{ 0 }; i < capacity; ++i)
+        {
+            co_await send(i);
+        }
+        BOOST_CHECK_EQUAL(router->getStatistics().mappings, capacity);
+        auto exhausted = false;
+        try
+        {
+            co_await send(capacity);
+        }
+        catch (std::overflow_error const&)
+        {
+            exhausted = true;
+        }
+        BOOST_CHECK(exhausted);
+        BOOST_CHECK_EQUAL(router->getStatistics().mappings, capacity);
+
+        co_await users.front().send(sink.local_endpoint(), "still mapped");
+        auto const from = co_await receiveFrom(sink);
+        co_await sink.async_send_to(boost::asio::buffer(std::string_view{ "reply" }), from);
+        auto [replyFrom, data] = co_await users.front().receive();
+        BOOST_CHECK_EQUAL(data, "reply");
+    }
+
+    // Many users behind one router talk to an echo peer at once; each must
+    // get back exactly its own datagrams. Every user runs on its own strand,
+    // so with more than one thread they call into the router concurrently.
+    awaitable<void> testConcurrentUsers(NatCase const natCase, int const scenario)
+    {
+        constexpr auto userCount = 32;
+        constexpr auto messages = 8;
+        auto executor = co_await this_coro::executor;
+        auto const router = natCase.policy.create
+        (
+            make_strand(executor),
+            makeAddress(scenario, natCase.lane, 1),
+            natCase.allocation
+        );
+        auto echo = makePeer(executor, makeAddress(scenario, natCase.lane, 2));
+        auto const echoEndPoint = echo.local_endpoint();
+        co_spawn
+        (
+            executor,
+            [&echo]() -> awaitable<void>
+            {
+                auto buffer = std::array<char, 64>{};
+                auto from = EndPoint{};
+                while (true)
+                {
+                    auto const received = co_await echo.async_receive_from(boost::asio::buffer(buffer), from);
+                    co_await echo.async_send_to(boost::asio::buffer(buffer.data(), received), from);
+                }
+            },
+            detached
+        );
+
+        // users are created before any traffic, since createUser is not
+        // serialized on the router strand
+        auto users = std::vector<Router::User>{};
+        for (auto u = 0; u < userCount; ++u)
+        {
+            users.push_back(router->createUser());
+        }
+
+        auto remaining = std::atomic<int>{ userCount };
+        auto failures = std::atomic<int>{ 0 };
+        for (auto const& user : users)
+        {
+            co_spawn
+            (
+                make_strand(executor),
+                [&, user]() -> awaitable<void>
+                {
+                    auto const tag = std::to_string(user.getId()) + ":";
+                    for (auto i = 0; i < messages; ++i)
+                    {
+                        co_await user.send(echoEndPoint, tag + std::to_string(i));
+                    }
+                    for (auto i = 0; i < messages; ++i)
+                    {
+                        auto [from, data] = co_await user.receive();
+                        failures += data.rfind(tag, 0) != 0 or from != echoEndPoint;
+                    }
+                    remaining -= 1;
+                },
+                detached
+            );
+        }
+
+        auto timer = steady_timer{ executor };
+        while (remaining > 0)
+        {
+            timer.expires_after(std::chrono::milliseconds{ 1 });
+            co_await timer.async_wait(use_awaitable);
+        }
+        BOOST_CHECK_EQUAL(failures, 0);
+
+        auto const statistics = router->getStatistics();
+        BOOST_CHECK_EQUAL(statistics.delivered, std::size_t{ userCount * messages });
+        BOOST_CHECK_EQUAL(statistics.filtered, 0);
+        BOOST_CHECK_EQUAL(statistics.mappings, userCount * expectedMappings(natCase.policy, 1));
+    }
+
+    // Fills a bare table one mapping at a time until it throws and returns
+    // how many mappings it took.
+    std::size_t fill(Router::Nat& nat, Mapping const mapping, Address const& remote)
+    {
+        auto count = std::size_t{ 0 };
+        try
+        {
+            while (true)
+            {
+                if (mapping == Mapping::EndpointDependent)
+                {
+                    nat.translate(1, EndPoint{ remote, static_cast<unsigned short>(count + 1) });
+                }
+                else
+                {
+                    nat.translate(static_cast<std::uint16_t>(count + 1), EndPoint{ remote, 1 });
+                }
+                count += 1;
+            }
+        }
+        catch (std::overflow_error const&)
+        {
+        }
+        return count;
+    }
+
+    // Compares the cost per operation in the first and last quarter of a
+    // run; a table whose operations get slower as it grows shows up as a
+    // last quarter far slower than the first. Each quarter is timed in
+    // slices and judged by its fastest slice, so preemption by other tests
+    // running in parallel does not count.
+    template<typename Operation>
+    void checkScaling(char const* const phase, std::size_t const count, Operation&& operation)
+    {
+        constexpr auto slices = std::size_t{ 16 };
+        auto fastest = std::array<double, 4>{};
+        auto index = std::size_t{ 0 };
+        for (auto quarter = std::size_t{ 0 }; quarter < 4; ++quarter)
+        {
+            fastest[quarter] = std::numeric_limits<double>::max();
+            for (auto slice = std::size_t{ 1 }; slice <= slices; ++slice)
+            {
+                auto const end = count * (quarter * slices + slice) / (4 * slices);
+                auto const start = std::chrono::steady_clock::now();
+                for (; index < end; ++index)
+                {
+                    operation(index);
+                }
+                auto const elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+                fastest[quarter] = std::min(fastest[quarter], elapsed.count());
+            }
+        }
+        BOOST_TEST_MESSAGE(phase << ": fastest slice " << fastest.front() << " us first, " << fastest.back() << " us last");
+        BOOST_CHECK_LE(fastest.back(), 4 * fastest.front() + 50);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(Conformance)
+
+BOOST_TEST_DECORATOR(*boost::unit_test::precondition(privileged(getNatCases(false))))
+BOOST_DATA_TEST_CASE(EndpointMapping, data::make(getNatCases(false)), natCase)
+{
+    run(testMapping(natCase));
+}
+
+BOOST_TEST_DECORATOR(*boost::unit_test::precondition(privileged(getNatCases(false))))
+BOOST_DATA_TEST_CASE(InboundFiltering, data::make(getNatCases(false)), natCase)
+{
+    run(testFiltering(natCase));
+}
+
+BOOST_TEST_DECORATOR(*boost::unit_test::precondition(privileged(getPeerCases())))
+BOOST_DATA_TEST_CASE(Traversal, data::make(getPeerCases()), peerCase)
+{
+    run(testTraversal(peerCase));
+}
+
+BOOST_TEST_DECORATOR(*boost::unit_test::precondition(privileged(getNatCases(false))))
+BOOST_DATA_TEST_CASE(ConcurrentUsers, data::make(getNatCases(false)), natCase)
+{
+    run(testConcurrentUsers(natCase, 24));
+}
+
+// The same traffic with four threads driving the context, so the router
+// strand, the users and the echo peer run in parallel.
+BOOST_TEST_DECORATOR(*boost::unit_test::precondition(privileged(getNatCases(false))))
+BOOST_DATA_TEST_CASE(ConcurrentUsersThreaded, data::make(getNatCases(false)), natCase)
+{
+    run(testConcurrentUsers(natCase, 26), 4);
+}
+
+// A full port-block table is tens of thousands of sockets; the bare table is
+// covered by TableExhaustion.
+BOOST_DATA_TEST_CASE(RouterExhaustion, data::make(getNatCases(true, { Allocation::Sequential })), natCase)
+{
+    run(testRouterExhaustion(natCase));
+}
+
+// Sequential allocation holds ports 10100 to 50100 in steps of 100, 401
+// mappings. Port blocks hold 867 blocks of 64 ports, one block per user for
+// cone NATs.
+BOOST_DATA_TEST_CASE(TableExhaustion, data::make(getNatCases(true)), natCase)
+{
+    auto const nat = natCase.policy.makeNat(natCase.allocation);
+    auto const remote = makeAddress(25, natCase.lane, 1);
+    auto const dependent = natCase.policy.mapping == Mapping::EndpointDependent;
+    auto const capacity = natCase.allocation == Allocation::Sequential
+        ? std::size_t{ 401 }
+        : std::size_t{ 867 } * (dependent ? Router::portBlockSize : 1);
+
+    BOOST_CHECK_EQUAL(fill(*nat, natCase.policy.mapping, remote), capacity);
+    BOOST_CHECK_EQUAL(nat->size(), capacity);
+    BOOST_CHECK_THROW(nat->translate(60000, EndPoint{ remote, 60000 }), std::overflow_error);
+    BOOST_CHECK_EQUAL(nat->size(), capacity);
+
+    // existing mappings survive exhaustion
+    auto const first = nat->translate(1, EndPoint{ remote, 1 });
+    BOOST_CHECK_EQUAL(nat->translate(first, EndPoint{ remote, 1 }).value_or(0), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(Stress)
+
+// Fills a port-block symmetric table to its last port, then looks every
+// mapping up again in both directions.
+BOOST_AUTO_TEST_CASE(SymmetricTable)
+{
+    constexpr auto capacity = std::size_t{ 867 } * Router::portBlockSize;
+    auto const nat = Router::makeNat<Router::Symmetric>(Allocation::PortBlock);
+    auto const remote = [](std::size_t const index)
+    {
+        auto const host = static_cast<unsigned char>(index >> 16);
+        auto const address = ip::address_v4{ ip::address_v4::bytes_type{ 10, 26, host, 1 } };
+        return EndPoint{ address, static_cast<unsigned short>(index & 0xFFFF) };
+    };
+    // 17 users with 51 full blocks each use up all 867 blocks
+    auto const local = [](std::size_t const index)
+    {
+        return static_cast<std::uint16_t>(1 + index / (51 * Router::portBlockSize));
+    };
+
+    auto translated = std::vector<Router::TranslatedID>(capacity);
+    checkScaling("insert", capacity, [&](std::size_t const index)
+    {
+        translated[index] = nat->translate(local(index), remote(index));
+    });
+    BOOST_CHECK_EQUAL(nat->size(), capacity);
+    BOOST_CHECK_THROW(nat->translate(1, remote(capacity)), std::overflow_error);
+
+    auto const unique = std::set<Router::TranslatedID>(cbegin(translated), cend(translated));
+    BOOST_CHECK_EQUAL(unique.size(), capacity);
+
+    auto mismatches = std::size_t{ 0 };
+    checkScaling("reuse", capacity, [&](std::size_t const index)
+    {
+        mismatches += nat->translate(local(index), remote(index)) != translated[index];
+    });
+    checkScaling("reverse", capacity, [&](std::size_t const index)
+    {
+        mismatches += nat->translate(translated[index], remote(index)) != local(index);
+    });
+    BOOST_CHECK_EQUAL(mismatches, 0);
+}
+
+// One user behind a restricted cone talks to 128k distinct peers: a single
+// mapping in front of a filter table with an entry per peer.
+BOOST_DATA_TEST_CASE
+(
+    FilterTable,
+    data::make(std::vector<NatCase>
+    {
+        NatCase{ getPolicies()[2], Allocation::Sequential, 0 },
+        NatCase{ getPolicies()[2], Allocation::PortBlock, 1 },
+        NatCase{ getPolicies()[3], Allocation::Sequential, 2 },
+        NatCase{ getPolicies()[3], Allocation::PortBlock, 3 },
+    }),
+    natCase
+)
+{
+    constexpr auto peers = std::size_t{ 1 } << 17;
+    auto const nat = natCase.policy.makeNat(natCase.allocation);
+    auto const remote = [](std::size_t const index, unsigned char const network)
+    {
+        auto const address = ip::address_v4{ ip::address_v4::bytes_type
+        {
+            10,
+            network,
+            static_cast<unsigned char>(index >> 8),
+            static_cast<unsigned char>(index & 0xFF),
+        } };
+        return EndPoint{ address, static_cast<unsigned short>(1000 + index % 7) };
+    };
+
+    auto const mapped = nat->translate(1, remote(0, 27));
+    auto mismatches = std::size_t{ 0 };
+    checkScaling("insert", peers, [&](std::size_t const index)
+    {
+        mismatches += nat->translate(1, remote(index, 27)) != mapped;
+    });
+    BOOST_CHECK_EQUAL(nat->size(), 1);
+
+    auto allowed = std::size_t{ 0 };
+    checkScaling("filter", peers, [&](std::size_t const index)
+    {
+        allowed += nat->translate(mapped, remote(index, 27)).has_value();
+    });
+    BOOST_CHECK_EQUAL(allowed, peers);
+    BOOST_CHECK_EQUAL(mismatches, 0);
+
+    // never contacted: filtered by both policies
+    auto leaked = std::size_t{ 0 };
+    for (auto index = std::size_t{ 0 }; index < peers; index += 97)
+    {
+        leaked += nat->translate(mapped, remote(index, 28)).has_value();
+    }
+    BOOST_CHECK_EQUAL(leaked, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
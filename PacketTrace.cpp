@@ -0,0 +1,221 @@
+#include "PacketTrace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Tests::Trace
+{
+    namespace
+    {
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<FlightRecorder*> recorders;
+            std::uint32_t lastThread = 0;
+        };
+
+        Registry& registry()
+        {
+            static auto instance = Registry{};
+            return instance;
+        }
+
+        struct Entry
+        {
+            Stamp stamp;
+            std::uint32_t thread;
+        };
+
+        // Writes entries sorted by time. The first stamp of a packet becomes an
+        // instant event, every later one a span from the stamp before it.
+        void writeTrace(std::ostream& out, std::vector<Entry>& entries)
+        {
+            using Micro = std::chrono::duration<double, std::micro>;
+            auto const toMicro = [](Clock::rep const ticks)
+            {
+                return std::chrono::duration_cast<Micro>(Clock::duration{ ticks }).count();
+            };
+
+            std::stable_sort
+            (
+                std::begin(entries),
+                std::end(entries),
+                [](Entry const& left, Entry const& right)
+                {
+                    return left.stamp.ticks < right.stamp.ticks;
+                }
+            );
+
+            auto previous = std::unordered_map<PacketId, Clock::rep>{};
+            auto first = true;
+            auto const flags = out.flags();
+            auto const precision = out.precision();
+            out << std::fixed << std::setprecision(3);
+            out << "{\"traceEvents\":[";
+            for (auto const& [stamp, thread] : entries)
+            {
+                out << (first ? "\n" : ",\n");
+                first = false;
+                out << "{\"name\":\"" << toString(stamp.stage) << "\",\"cat\":\"packet\"";
+                out << ",\"pid\":0,\"tid\":" << thread;
+                if (auto const found = previous.find(stamp.packet); found != cend(previous))
+                {
+                    auto const since = found->second;
+                    out << ",\"ph\":\"X\",\"ts\":" << toMicro(since);
+                    out << ",\"dur\":" << toMicro(stamp.ticks - since);
+                }
+                else
+                {
+                    out << ",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << toMicro(stamp.ticks);
+                }
+                out << ",\"args\":{\"packet\":" << stamp.packet;
+                out << ",\"port\":" << stamp.port << "}}";
+                previous[stamp.packet] = stamp.ticks;
+            }
+            out << "\n]}\n";
+            out.flags(flags);
+            out.precision(precision);
+        }
+    }
+
+    std::string_view toString(Stage const stage) noexcept
+    {
+        switch (stage)
+        {
+        case Stage::SendBegin: return "send";
+        case Stage::Scheduled: return "strand";
+        case Stage::Translated: return "translate";
+        case Stage::SocketReady: return "socket";
+        case Stage::Sent: return "send_to";
+        case Stage::Received: return "receive_from";
+        case Stage::ReverseTranslated: return "reverse_translate";
+        case Stage::Delivered: return "deliver";
+        case Stage::Woken: return "wake";
+        case Stage::Failed: return "failed";
+        }
+        return "unknown";
+    }
+
+    FlightRecorder::FlightRecorder()
+    {
+        auto& shared = registry();
+        auto const lock = std::lock_guard{ shared.mutex };
+        shared.lastThread += 1;
+        m_thread = shared.lastThread;
+        shared.recorders.push_back(this);
+    }
+
+    FlightRecorder::~FlightRecorder()
+    {
+        auto& shared = registry();
+        auto const lock = std::lock_guard{ shared.mutex };
+        auto& recorders = shared.recorders;
+        recorders.erase
+        (
+            std::remove(std::begin(recorders), std::end(recorders), this),
+            std::end(recorders)
+        );
+    }
+
+    FlightRecorder& FlightRecorder::local()
+    {
+        thread_local auto recorder = FlightRecorder{};
+        return recorder;
+    }
+
+    std::size_t FlightRecorder::size() const noexcept
+    {
+        return std::min(m_next, capacity);
+    }
+
+    void FlightRecorder::clear() noexcept
+    {
+        m_next = 0;
+    }
+
+    template<typename Visitor>
+    void FlightRecorder::visit(Visitor&& visitor) const
+    {
+        auto const oldest = m_next - size();
+        for (auto i = oldest; i < m_next; ++i)
+        {
+            visitor(m_ring[i % capacity], m_thread);
+        }
+    }
+
+    void FlightRecorder::dump(std::ostream& out) const
+    {
+        auto entries = std::vector<Entry>{};
+        entries.reserve(size());
+        visit([&](Stamp const& stamp, std::uint32_t const thread)
+        {
+            entries.push_back(Entry{ stamp, thread });
+        });
+        writeTrace(out, entries);
+    }
+
+    void FlightRecorder::dumpAll(std::ostream& out)
+    {
+        auto entries = std::vector<Entry>{};
+        {
+            auto& shared = registry();
+            auto const lock = std::lock_guard{ shared.mutex };
+            for (auto const recorder : shared.recorders)
+            {
+                recorder->visit([&](Stamp const& stamp, std::uint32_t const thread)
+                {
+                    entries.push_back(Entry{ stamp, thread });
+                });
+            }
+        }
+        writeTrace(out, entries);
+    }
+
+    PacketId nextPacket() noexcept
+    {
+        static auto counter = std::atomic<PacketId>{ 0 };
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    void dumpOnError(PacketId const packet, std::uint16_t const port) noexcept
+    {
+        try
+        {
+            auto& recorder = FlightRecorder::local();
+            recorder.record(packet, port, Stage::Failed);
+            auto const path = std::getenv("ROUTER_TRACE_DUMP");
+            if (path == nullptr)
+            {
+                return;
+            }
+
+            // a burst of failures, such as an exhausted NAT table, rewrites
+            // the file once instead of once per packet
+            static auto lastDump = std::atomic<Clock::rep>{ 0 };
+            auto const now = Clock::now().time_since_epoch().count();
+            auto last = lastDump.load(std::memory_order_relaxed);
+            auto const interval = std::chrono::duration_cast<Clock::duration>(std::chrono::seconds{ 1 }).count();
+            if (last != 0 and now - last < interval)
+            {
+                return;
+            }
+            if (not lastDump.compare_exchange_strong(last, now, std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            // only this thread's ring: the others are still being written
+            auto file = std::ofstream{ path, std::ios::trunc };
+            recorder.dump(file);
+        }
+        catch (...)
+        {
+            // the flight recorder must never turn one failure into another
+        }
+    }
+}
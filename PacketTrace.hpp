@@ -0,0 +1,129 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+namespace Tests::Trace
+{
+#if defined(ROUTER_TRACE)
+    inline constexpr bool enabled = true;
+#else
+    inline constexpr bool enabled = false;
+#endif
+
+    using Clock = std::chrono::steady_clock;
+    using PacketId = std::uint32_t;
+
+    enum class Stage : std::uint8_t
+    {
+        SendBegin,
+        Scheduled,
+        Translated,
+        SocketReady,
+        Sent,
+        Received,
+        ReverseTranslated,
+        Delivered,
+        Woken,
+        Failed,
+    };
+
+    std::string_view toString(Stage const stage) noexcept;
+
+    struct Stamp
+    {
+        Clock::rep ticks;
+        PacketId packet;
+        std::uint16_t port;
+        Stage stage;
+    };
+
+    // Fixed-size ring of the most recent stamps taken on one thread. Writing
+    // a stamp is a store and an increment; older stamps are overwritten.
+    class FlightRecorder
+    {
+    public:
+        static constexpr std::size_t capacity = 1 << 14;
+
+    private:
+        std::array<Stamp, capacity> m_ring;
+        std::size_t m_next = 0;
+        std::uint32_t m_thread;
+
+    public:
+        FlightRecorder();
+        FlightRecorder(FlightRecorder const&) = delete;
+        FlightRecorder& operator=(FlightRecorder const&) = delete;
+        ~FlightRecorder();
+
+        // The recorder of the calling thread.
+        static FlightRecorder& local();
+
+        void record(PacketId const packet, std::uint16_t const port, Stage const stage) noexcept
+        {
+            auto& stamp = m_ring[m_next % capacity];
+            stamp.ticks = Clock::now().time_since_epoch().count();
+            stamp.packet = packet;
+            stamp.port = port;
+            stamp.stage = stage;
+            m_next += 1;
+        }
+
+        std::size_t size() const noexcept;
+        void clear() noexcept;
+
+        // Writes the recorded stamps as Chrome trace events: one complete
+        // event per stage, spanning from the previous stamp of the same
+        // packet. The output loads in chrome://tracing and Perfetto.
+        void dump(std::ostream& out) const;
+
+        // Dumps the recorders of every live thread into a single trace.
+        // Other threads keep recording, so call it when they are quiescent.
+        static void dumpAll(std::ostream& out);
+
+    private:
+        template<typename Visitor>
+        void visit(Visitor&& visitor) const;
+    };
+
+    PacketId nextPacket() noexcept;
+
+    // Call sites use these; they compile to nothing unless ROUTER_TRACE is
+    // defined.
+    inline PacketId start(std::uint16_t const port, Stage const stage) noexcept
+    {
+        if constexpr (enabled)
+        {
+            auto const packet = nextPacket();
+            FlightRecorder::local().record(packet, port, stage);
+            return packet;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    inline void stamp(PacketId const packet, std::uint16_t const port, Stage const stage) noexcept
+    {
+        if constexpr (enabled)
+        {
+            FlightRecorder::local().record(packet, port, stage);
+        }
+    }
+
+    void dumpOnError(PacketId const packet, std::uint16_t const port) noexcept;
+
+    // Records the failure and dumps the calling thread's recorder to the file
+    // named by the ROUTER_TRACE_DUMP environment variable, if set, at most
+    // once a second.
+    inline void fail(PacketId const packet, std::uint16_t const port) noexcept
+    {
+        if constexpr (enabled)
+        {
+            dumpOnError(packet, port);
+        }
+    }
+}
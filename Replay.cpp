@@ -0,0 +1,642 @@
+#include "Replay.hpp"
+#include <boost/container_hash/hash.hpp>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+
+using std::move;
+
+namespace Tests
+{
+    namespace
+    {
+        using EndPoint = Router::EndPoint;
+        using Address = Router::Address;
+
+        constexpr auto headerSize = std::size_t{ 24 };
+        constexpr auto recordHeaderSize = std::size_t{ 16 };
+        constexpr auto udpHeaderSize = std::size_t{ 8 };
+        constexpr auto maxPayload = std::size_t{ 1400 };
+        constexpr auto tagSize = std::size_t{ 2 };
+
+        enum LinkType : std::uint32_t
+        {
+            Null = 0,
+            Ethernet = 1,
+            Raw = 101,
+            LinuxCooked = 113,
+            Ipv4 = 228,
+            Ipv6 = 229,
+            LinuxCooked2 = 276,
+        };
+
+        std::uint16_t network16(std::byte const* const data) noexcept
+        {
+            return static_cast<std::uint16_t>
+            (
+                (std::to_integer<unsigned>(data[0]) << 8) | std::to_integer<unsigned>(data[1])
+            );
+        }
+
+        std::uint32_t network32(std::byte const* const data) noexcept
+        {
+            return (std::uint32_t{ network16(data) } << 16) | network16(data + 2);
+        }
+
+        struct EndPointHash
+        {
+            std::size_t operator()(EndPoint const& endPoint) const
+            {
+                auto hash = std::size_t{ 0 };
+                auto const address = endPoint.address();
+                if (address.is_v4())
+                {
+                    boost::hash_combine(hash, address.to_v4().to_uint());
+                }
+                else
+                {
+                    boost::hash_combine(hash, address.to_v6().to_bytes());
+                }
+                boost::hash_combine(hash, endPoint.port());
+                return hash;
+            }
+        };
+
+        // Errors from opening or binding a socket that mean the process or
+        // the system ran out of descriptors or ports, rather than a bug.
+        bool isExhausted(boost::system::error_code const& code) noexcept
+        {
+            return code == boost::asio::error::no_descriptors
+                or code == boost::system::errc::too_many_files_open_in_system
+                or code == boost::asio::error::no_buffer_space
+                or code == boost::asio::error::address_in_use;
+        }
+
+        bool isInside(Address const& address, ReplayOptions const& options)
+        {
+            auto const& network = options.insideNetwork;
+            if (address.is_v4() != network.is_v4())
+            {
+                return false;
+            }
+            auto const bytes = [](Address const& value)
+            {
+                auto result = std::array<unsigned char, 16>{};
+                if (value.is_v4())
+                {
+                    auto const v4 = value.to_v4().to_bytes();
+                    std::copy(begin(v4), end(v4), begin(result));
+                }
+                else
+                {
+                    result = value.to_v6().to_bytes();
+                }
+                return result;
+            };
+            auto const left = bytes(address);
+            auto const right = bytes(network);
+            auto remaining = options.prefixLength;
+            for (auto i = std::size_t{ 0 }; remaining > 0 and i < left.size(); ++i)
+            {
+                auto const bits = std::min(remaining, 8u);
+                auto const mask = static_cast<unsigned char>(0xFF << (8 - bits));
+                if ((left[i] & mask) != (right[i] & mask))
+                {
+                    return false;
+                }
+                remaining -= bits;
+            }
+            return true;
+        }
+
+        // A remote peer of the trace. It learns the public endpoint of each
+        // inside user from the tag in front of the datagrams it receives.
+        struct Peer
+        {
+            Router::Socket socket;
+            EndPoint local;
+            std::unordered_map<std::uint16_t, EndPoint> learned;
+        };
+
+        class Engine
+        {
+        public:
+            template<typename T>
+            using Awaitable = Router::Awaitable<T>;
+
+        private:
+            ReplayOptions const& m_options;
+            ReplayReport& m_report;
+            std::shared_ptr<Router> m_router;
+            boost::asio::any_io_executor m_executor;
+            std::unordered_map<EndPoint, Router::User, EndPointHash> m_users;
+            std::unordered_map<EndPoint, std::unique_ptr<Peer>, EndPointHash> m_peers;
+            std::unordered_map<std::uint16_t, EndPoint> m_learned;
+            std::string m_scratch;
+
+        public:
+            Engine
+            (
+                ReplayOptions const& options,
+                ReplayReport& report,
+                std::shared_ptr<Router> router,
+                boost::asio::any_io_executor executor
+            ) :
+                m_options{ options },
+                m_report{ report },
+                m_router{ move(router) },
+                m_executor{ move(executor) }
+            {}
+
+            Awaitable<void> run(PcapReader& reader)
+            {
+                auto timer = boost::asio::steady_timer{ m_executor };
+                auto const start = std::chrono::steady_clock::now();
+                auto first = std::optional<std::chrono::nanoseconds>{};
+                while (m_options.maxPackets == 0 or m_report.datagrams < m_options.maxPackets)
+                {
+                    auto const datagram = reader.next();
+                    if (not datagram.has_value())
+                    {
+                        break;
+                    }
+                    m_report.datagrams += 1;
+
+                    if (m_options.realTime)
+                    {
+                        if (not first.has_value())
+                        {
+                            first = datagram->timestamp;
+                        }
+                        timer.expires_at(start + (datagram->timestamp - *first));
+                        co_await timer.async_wait(boost::asio::use_awaitable);
+                    }
+
+                    if (isInside(datagram->source.address(), m_options))
+                    {
+                        co_await outbound(*datagram);
+                    }
+                    else if (isInside(datagram->destination.address(), m_options))
+                    {
+                        co_await inbound(*datagram);
+                    }
+                    else
+                    {
+                        m_report.transit += 1;
+                    }
+
+                    if (m_options.sampleInterval != 0 and m_report.datagrams % m_options.sampleInterval == 0)
+                    {
+                        sample();
+                    }
+                }
+                m_report.elapsed = std::chrono::steady_clock::now() - start;
+
+                // let datagrams still in flight reach the router
+                timer.expires_after(std::chrono::milliseconds{ 50 });
+                co_await timer.async_wait(boost::asio::use_awaitable);
+
+                sample();
+                m_report.skipped = reader.getSkipped();
+                m_report.users = m_users.size();
+                m_report.peers = m_peers.size();
+                m_report.router = m_router->getStatistics();
+            }
+
+        private:
+            Awaitable<void> outbound(PcapReader::Datagram const& datagram)
+            {
+                auto const user = getUser(datagram.source);
+                if (user == nullptr)
+                {
+                    m_report.exhausted += 1;
+                    co_return;
+                }
+                auto const peer = getPeer(datagram.destination);
+                if (peer == nullptr)
+                {
+                    m_report.exhausted += 1;
+                    co_return;
+                }
+
+                auto const id = static_cast<std::uint16_t>(user->getId());
+                auto const length = std::min(datagram.payload.size(), maxPayload - tagSize);
+                m_scratch.resize(tagSize + length);
+                m_scratch[0] = static_cast<char>(id >> 8);
+                m_scratch[1] = static_cast<char>(id & 0xFF);
+                std::memcpy(m_scratch.data() + tagSize, datagram.payload.data(), length);
+                try
+                {
+                    co_await user->send(peer->local, m_scratch);
+                    m_report.outbound += 1;
+                }
+                catch (std::overflow_error const&)
+                {
+                    m_report.exhausted += 1;
+                }
+                catch (boost::system::system_error const& error)
+                {
+                    // the router could not open the socket for a new mapping
+                    if (not isExhausted(error.code()))
+                    {
+                        throw;
+                    }
+                    m_report.exhausted += 1;
+                }
+            }
+
+            Awaitable<void> inbound(PcapReader::Datagram const& datagram)
+            {
+                auto const found = m_users.find(datagram.destination);
+                if (found == cend(m_users))
+                {
+                    m_report.unsolicited += 1;
+                    co_return;
+                }
+                auto const id = static_cast<std::uint16_t>(found->second.getId());
+                auto const peer = getPeer(datagram.source);
+                if (peer == nullptr)
+                {
+                    m_report.exhausted += 1;
+                    co_return;
+                }
+
+                // a reply can overtake the peer learning about its request,
+                // so give the peer's receive loop a few turns to catch up
+                auto target = std::optional<EndPoint>{};
+                for (auto attempt = 0; attempt < 16 and not target.has_value(); ++attempt)
+                {
+                    if (auto const own = peer->learned.find(id); own != cend(peer->learned))
+                    {
+                        target = own->second;
+                    }
+                    else if (auto const any = m_learned.find(id); any != cend(m_learned))
+                    {
+                        // the endpoint another peer saw, as if signalled to
+                        // this one by a rendezvous server
+                        target = any->second;
+                    }
+                    else
+                    {
+                        co_await boost::asio::post(m_executor, boost::asio::use_awaitable);
+                    }
+                }
+                if (not target.has_value())
+                {
+                    m_report.unsolicited += 1;
+                    co_return;
+                }
+
+                auto const length = std::min(datagram.payload.size(), maxPayload);
+                co_await peer->socket.async_send_to
+                (
+                    boost::asio::buffer(datagram.payload.data(), length),
+                    *target
+                );
+                m_report.inbound += 1;
+            }
+
+            Router::User const* getUser(EndPoint const& source)
+            {
+                if (auto const found = m_users.find(source); found != cend(m_users))
+                {
+                    return &found->second;
+                }
+                if (m_users.size() >= std::numeric_limits<std::uint16_t>::max())
+                {
+                    return nullptr;
+                }
+                auto [kv, emplaced] = m_users.try_emplace(source, m_router->createUser());
+                auto& [key, user] = *kv;
+                boost::asio::co_spawn(m_executor, drain(user), boost::asio::detached);
+                return &user;
+            }
+
+            // Every remote endpoint needs its own socket so the router sees
+            // distinct destinations. Traces with more remote endpoints than
+            // the descriptor limit run out of sockets; those peers are
+            // counted as exhausted rather than aborting the replay.
+            Peer* getPeer(EndPoint const& remote)
+            {
+                if (auto const found = m_peers.find(remote); found != cend(m_peers))
+                {
+                    return found->second.get();
+                }
+                auto peer = std::make_unique<Peer>(Peer{ Router::Socket{ m_executor }, {}, {} });
+                auto const bind = EndPoint{ m_options.peerAddress, 0 };
+                try
+                {
+                    peer->socket.open(bind.protocol());
+                    peer->socket.bind(bind);
+                }
+                catch (boost::system::system_error const& error)
+                {
+                    if (not isExhausted(error.code()))
+                    {
+                        throw;
+                    }
+                    return nullptr;
+                }
+                peer->local = peer->socket.local_endpoint();
+                auto& [key, stored] = *m_peers.try_emplace(remote, move(peer)).first;
+                boost::asio::co_spawn(m_executor, learn(*stored), boost::asio::detached);
+                return stored.get();
+            }
+
+            // Takes the user by reference so a parked drain does not keep
+            // the router alive; destroying the router abandons it.
+            static Awaitable<void> drain(Router::User const& user)
+            {
+                while (true)
+                {
+                    co_await user.receive();
+                }
+            }
+
+            Awaitable<void> learn(Peer& peer)
+            {
+                auto buffer = std::array<char, maxPayload>{};
+                auto from = EndPoint{};
+                while (true)
+                {
+                    auto const received = co_await peer.socket.async_receive_from
+                    (
+                        boost::asio::buffer(buffer),
+                        from
+                    );
+                    if (received < tagSize)
+                    {
+                        continue;
+                    }
+                    auto const id = static_cast<std::uint16_t>
+                    (
+                        (static_cast<unsigned char>(buffer[0]) << 8) | static_cast<unsigned char>(buffer[1])
+                    );
+                    peer.learned[id] = from;
+                    m_learned[id] = from;
+                }
+            }
+
+            void sample()
+            {
+                auto const mappings = m_router->getStatistics().mappings;
+                m_report.growth.push_back(ReplayReport::Sample{ m_report.datagrams, mappings });
+            }
+        };
+    }
+
+    PcapReader::PcapReader(std::string const& path) :
+        m_file{ path.c_str(), boost::interprocess::read_only },
+        m_region{ m_file, boost::interprocess::read_only },
+        m_data{ static_cast<std::byte const*>(m_region.get_address()) },
+        m_size{ m_region.get_size() },
+        m_offset{ headerSize }
+    {
+        m_region.advise(boost::interprocess::mapped_region::advice_sequential);
+        if (m_size < headerSize)
+        {
+            throw std::invalid_argument{ "pcap file too short" };
+        }
+
+        auto magic = std::uint32_t{ 0 };
+        std::memcpy(&magic, m_data, sizeof(magic));
+        switch (magic)
+        {
+        case 0xA1B2C3D4: m_swapped = false; m_nanoseconds = false; break;
+        case 0xD4C3B2A1: m_swapped = true; m_nanoseconds = false; break;
+        case 0xA1B23C4D: m_swapped = false; m_nanoseconds = true; break;
+        case 0x4D3CB2A1: m_swapped = true; m_nanoseconds = true; break;
+        default: throw std::invalid_argument{ "not a pcap file" };
+        }
+        m_linkType = read32(m_data + 20) & 0x0FFFFFFF;
+    }
+
+    std::optional<PcapReader::Datagram> PcapReader::next()
+    {
+        while (m_offset + recordHeaderSize <= m_size)
+        {
+            auto const record = m_data + m_offset;
+            auto const seconds = read32(record);
+            auto const fraction = read32(record + 4);
+            auto const captured = std::size_t{ read32(record + 8) };
+            m_offset += recordHeaderSize;
+            if (captured > m_size - m_offset)
+            {
+                // truncated capture; nothing after this point is usable
+                m_offset = m_size;
+                break;
+            }
+
+            auto const timestamp = std::chrono::seconds{ seconds } + (m_nanoseconds
+                ? std::chrono::nanoseconds{ fraction }
+                : std::chrono::nanoseconds{ std::chrono::microseconds{ fraction } });
+            auto const data = m_data + m_offset;
+            m_offset += captured;
+            if (auto datagram = parse(data, captured, timestamp))
+            {
+                return datagram;
+            }
+            m_skipped += 1;
+        }
+        return std::nullopt;
+    }
+
+    std::size_t PcapReader::getSkipped() const noexcept
+    {
+        return m_skipped;
+    }
+
+    std::uint32_t PcapReader::read32(std::byte const* const data) const noexcept
+    {
+        auto value = std::uint32_t{ 0 };
+        std::memcpy(&value, data, sizeof(value));
+        if (m_swapped)
+        {
+            value = ((value & 0x000000FF) << 24) | ((value & 0x0000FF00) << 8)
+                | ((value & 0x00FF0000) >> 8) | ((value & 0xFF000000) >> 24);
+        }
+        return value;
+    }
+
+    std::optional<PcapReader::Datagram> PcapReader::parse
+    (
+        std::byte const* data,
+        std::size_t length,
+        std::chrono::nanoseconds const timestamp
+    ) const
+    {
+        auto const skip = [&](std::size_t const count)
+        {
+            if (count > length)
+            {
+                return false;
+            }
+            data += count;
+            length -= count;
+            return true;
+        };
+
+        auto etherType = std::uint16_t{ 0 };
+        switch (m_linkType)
+        {
+        case Ethernet:
+            if (not skip(14))
+            {
+                return std::nullopt;
+            }
+            etherType = network16(data - 2);
+            while (etherType == 0x8100 or etherType == 0x88A8)
+            {
+                if (not skip(4))
+                {
+                    return std::nullopt;
+                }
+                etherType = network16(data - 2);
+            }
+            break;
+        case LinuxCooked:
+            if (not skip(16))
+            {
+                return std::nullopt;
+            }
+            etherType = network16(data - 2);
+            break;
+        case LinuxCooked2:
+            if (length < 20)
+            {
+                return std::nullopt;
+            }
+            etherType = network16(data);
+            skip(20);
+            break;
+        case Null:
+        {
+            if (length < 4)
+            {
+                return std::nullopt;
+            }
+            // the family is in the byte order of the capturing host
+            auto family = std::uint32_t{ 0 };
+            std::memcpy(&family, data, sizeof(family));
+            if (family > 0xFFFF)
+            {
+                family >>= 24;
+            }
+            etherType = family == 2 ? 0x0800 : 0x86DD;
+            skip(4);
+            break;
+        }
+        case Raw:
+        case Ipv4:
+        case Ipv6:
+            break;
+        default:
+            return std::nullopt;
+        }
+
+        if (etherType == 0 and length > 0)
+        {
+            etherType = (std::to_integer<unsigned>(data[0]) >> 4) == 6 ? 0x86DD : 0x0800;
+        }
+
+        auto datagram = Datagram{};
+        datagram.timestamp = timestamp;
+        if (etherType == 0x0800)
+        {
+            if (length < 20 or (std::to_integer<unsigned>(data[0]) >> 4) != 4)
+            {
+                return std::nullopt;
+            }
+            auto const headerLength = std::size_t{ std::to_integer<unsigned>(data[0]) & 0x0Fu } * 4;
+            auto const totalLength = std::size_t{ network16(data + 2) };
+            auto const fragment = network16(data + 6) & 0x3FFF;
+            if (std::to_integer<unsigned>(data[9]) != 17 or fragment != 0 or headerLength < 20)
+            {
+                return std::nullopt;
+            }
+            datagram.source.address(boost::asio::ip::address_v4{ network32(data + 12) });
+            datagram.destination.address(boost::asio::ip::address_v4{ network32(data + 16) });
+            length = std::min(length, std::max(totalLength, headerLength));
+            if (not skip(headerLength))
+            {
+                return std::nullopt;
+            }
+        }
+        else if (etherType == 0x86DD)
+        {
+            if (length < 40 or std::to_integer<unsigned>(data[6]) != 17)
+            {
+                return std::nullopt;
+            }
+            auto source = boost::asio::ip::address_v6::bytes_type{};
+            auto destination = boost::asio::ip::address_v6::bytes_type{};
+            std::memcpy(source.data(), data + 8, source.size());
+            std::memcpy(destination.data(), data + 24, destination.size());
+            datagram.source.address(boost::asio::ip::address_v6{ source });
+            datagram.destination.address(boost::asio::ip::address_v6{ destination });
+            length = std::min(length, 40 + std::size_t{ network16(data + 4) });
+            skip(40);
+        }
+        else
+        {
+            return std::nullopt;
+        }
+
+        if (length < udpHeaderSize)
+        {
+            return std::nullopt;
+        }
+        datagram.source.port(network16(data));
+        datagram.destination.port(network16(data + 2));
+        auto const udpLength = std::max(std::size_t{ network16(data + 4) }, udpHeaderSize);
+        length = std::min(length, udpLength);
+        skip(udpHeaderSize);
+        datagram.payload = std::string_view{ reinterpret_cast<char const*>(data), length };
+        return datagram;
+    }
+
+    double ReplayReport::getPacketsPerSecond() const noexcept
+    {
+        auto const seconds = std::chrono::duration<double>(elapsed).count();
+        return seconds > 0 ? (outbound + inbound) / seconds : 0;
+    }
+
+    ReplayReport replay
+    (
+        std::string const& path,
+        ReplayOptions const& options,
+        RouterFactory const& factory
+    )
+    {
+        auto reader = PcapReader{ path };
+        auto report = ReplayReport{};
+        auto context = boost::asio::io_context{ 1 };
+        auto error = std::exception_ptr{};
+        {
+            auto engine = Engine
+            {
+                options,
+                report,
+                factory(boost::asio::make_strand(context), options.routerAddress),
+                context.get_executor()
+            };
+            boost::asio::co_spawn
+            (
+                context,
+                engine.run(reader),
+                [&](std::exception_ptr const exception)
+                {
+                    error = exception;
+                    context.stop();
+                }
+            );
+            context.run();
+        }
+        if (error != nullptr)
+        {
+            std::rethrow_exception(error);
+        }
+        return report;
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include "Routers.hpp"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Tests
+{
+    // Streams UDP datagrams out of a pcap file. The file is memory-mapped
+    // and walked front to back, so only the pages being parsed are resident.
+    // Ethernet (with VLAN tags), Linux cooked, BSD loopback and raw IP link
+    // types are understood; anything that is not an unfragmented UDP datagram
+    // is skipped.
+    class PcapReader
+    {
+    public:
+        struct Datagram
+        {
+            std::chrono::nanoseconds timestamp;
+            Router::EndPoint source;
+            Router::EndPoint destination;
+            std::string_view payload;
+        };
+
+    private:
+        boost::interprocess::file_mapping m_file;
+        boost::interprocess::mapped_region m_region;
+        std::byte const* m_data;
+        std::size_t m_size;
+        std::size_t m_offset;
+        std::uint32_t m_linkType;
+        bool m_swapped;
+        bool m_nanoseconds;
+        std::size_t m_skipped = 0;
+
+    public:
+        explicit PcapReader(std::string const& path);
+
+        // The next UDP datagram, or nothing at the end of the file. The
+        // payload points into the mapping and lives as long as the reader.
+        std::optional<Datagram> next();
+
+        std::size_t getSkipped() const noexcept;
+
+    private:
+        std::uint32_t read32(std::byte const* const data) const noexcept;
+        std::optional<Datagram> parse
+        (
+            std::byte const* data,
+            std::size_t length,
+            std::chrono::nanoseconds const timestamp
+        ) const;
+    };
+
+    struct ReplayOptions
+    {
+        // Trace addresses inside this network are users behind the router
+        // under test; every other address is a remote peer.
+        Router::Address insideNetwork = boost::asio::ip::make_address("10.0.0.0");
+        unsigned prefixLength = 8;
+        Router::Address routerAddress = boost::asio::ip::make_address("127.0.0.2");
+        // Every remote peer binds here on its own port, so address-restricted
+        // filtering only ever sees one remote address.
+        Router::Address peerAddress = boost::asio::ip::make_address("127.0.0.3");
+        // Keep the inter-packet gaps of the trace instead of replaying as
+        // fast as possible.
+        bool realTime = false;
+        std::size_t maxPackets = 0;
+        std::size_t sampleInterval = 1024;
+    };
+
+    struct ReplayReport
+    {
+        struct Sample
+        {
+            std::size_t packets;
+            std::size_t mappings;
+        };
+
+        std::size_t datagrams = 0;
+        std::size_t outbound = 0;
+        std::size_t inbound = 0;
+        // Inbound datagrams to an inside host that never sent anything, so
+        // there is no public endpoint to aim them at.
+        std::size_t unsolicited = 0;
+        std::size_t transit = 0;
+        std::size_t skipped = 0;
+        // Datagrams dropped because the NAT table, the user ids, the local
+        // sockets for remote peers or the router's own sockets ran out.
+        std::size_t exhausted = 0;
+        std::size_t users = 0;
+        std::size_t peers = 0;
+        Router::Statistics router{};
+        std::vector<Sample> growth;
+        std::chrono::steady_clock::duration elapsed{};
+
+        double getPacketsPerSecond() const noexcept;
+    };
+
+    using RouterFactory = std::function<std::shared_ptr<Router>
+    (
+        Router::Strand strand,
+        Router::Address const& address
+    )>;
+
+    // Replays a trace through a router built by factory. Inside sources
+    // become Router::Users created on demand and inject through User::send;
+    // remote endpoints become plain sockets that learn the public endpoints
+    // of inside users from what they receive and send the inbound half of
+    // the trace back to them.
+    ReplayReport replay
+    (
+        std::string const& path,
+        ReplayOptions const& options,
+        RouterFactory const& factory
+    );
+
+    template<typename T>
+    ReplayReport replay
+    (
+        std::string const& path,
+        ReplayOptions const& options,
+        Router::Allocation const allocation = Router::Allocation::Sequential
+    )
+    {
+        auto const factory = [allocation](Router::Strand strand, Router::Address const& address)
+        {
+            return Router::create<T>(std::move(strand), address, Router::Backend::Reactor, allocation);
+        };
+        return replay(path, options, factory);
+    }
+}
@@ -0,0 +1,137 @@
+#include "Replay.hpp"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// Replays the UDP half of a pcap trace through one router and prints what
+// the router made of it: packets/sec, how the mapping table grew, and how
+// many inbound datagrams got through the filter.
+//
+//     RouterReplay <trace.pcap> [policy] [options]
+//
+// policy is one of nonat, fullcone, address, port (default) or symmetric.
+//     --inside <address>/<prefix>   inside network of the trace (10.0.0.0/8)
+//     --realtime                    keep the trace's inter-packet gaps
+//     --port-block                  allocate ports in blocks of 64 per user
+//     --max <n>                     stop after n datagrams
+
+using namespace Tests;
+
+namespace
+{
+    void usage()
+    {
+        std::cerr << "usage: RouterReplay <trace.pcap> [nonat|fullcone|address|port|symmetric]"
+            " [--inside <address>/<prefix>] [--realtime] [--port-block] [--max <n>]\n";
+    }
+
+    ReplayReport run
+    (
+        std::string const& path,
+        std::string_view const policy,
+        ReplayOptions const& options,
+        Router::Allocation const allocation
+    )
+    {
+        if (policy == "nonat")
+        {
+            return replay<Router::NoNat>(path, options, allocation);
+        }
+        if (policy == "fullcone")
+        {
+            return replay<Router::FullCone>(path, options, allocation);
+        }
+        if (policy == "address")
+        {
+            return replay<Router::AddressRestricted>(path, options, allocation);
+        }
+        if (policy == "port")
+        {
+            return replay<Router::PortRestricted>(path, options, allocation);
+        }
+        if (policy == "symmetric")
+        {
+            return replay<Router::Symmetric>(path, options, allocation);
+        }
+        throw std::invalid_argument{ "unknown policy " + std::string{ policy } };
+    }
+
+    void print(ReplayReport const& report)
+    {
+        auto const seconds = std::chrono::duration<double>(report.elapsed).count();
+        std::cout << "datagrams:   " << report.datagrams << " (" << report.skipped << " other frames skipped)\n";
+        std::cout << "outbound:    " << report.outbound << '\n';
+        std::cout << "inbound:     " << report.inbound << '\n';
+        std::cout << "unsolicited: " << report.unsolicited << '\n';
+        std::cout << "transit:     " << report.transit << '\n';
+        std::cout << "exhausted:   " << report.exhausted << '\n';
+        std::cout << "users:       " << report.users << ", peers: " << report.peers << '\n';
+        std::cout << "mappings:    " << report.router.mappings << '\n';
+        std::cout << "delivered:   " << report.router.delivered << ", filtered: " << report.router.filtered;
+        std::cout << ", truncated: " << report.router.truncated << '\n';
+        std::cout << "elapsed:     " << seconds << " s, " << report.getPacketsPerSecond() << " packets/sec\n";
+        std::cout << "growth (packets mappings):\n";
+        for (auto const& sample : report.growth)
+        {
+            std::cout << "    " << sample.packets << ' ' << sample.mappings << '\n';
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    auto const path = std::string{ argv[1] };
+    auto policy = std::string_view{ "port" };
+    auto options = ReplayOptions{};
+    auto allocation = Router::Allocation::Sequential;
+    try
+    {
+        for (auto i = 2; i < argc; ++i)
+        {
+            auto const argument = std::string_view{ argv[i] };
+            if (argument == "--realtime")
+            {
+                options.realTime = true;
+            }
+            else if (argument == "--port-block")
+            {
+                allocation = Router::Allocation::PortBlock;
+            }
+            else if (argument == "--max" and i + 1 < argc)
+            {
+                options.maxPackets = std::strtoull(argv[++i], nullptr, 10);
+            }
+            else if (argument == "--inside" and i + 1 < argc)
+            {
+                auto const network = std::string{ argv[++i] };
+                auto const slash = network.find('/');
+                options.insideNetwork = boost::asio::ip::make_address(network.substr(0, slash));
+                options.prefixLength = slash == std::string::npos
+                    ? (options.insideNetwork.is_v4() ? 32 : 128)
+                    : static_cast<unsigned>(std::stoul(network.substr(slash + 1)));
+            }
+            else if (argument.substr(0, 2) != "--")
+            {
+                policy = argument;
+            }
+            else
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+        }
+        print(run(path, policy, options, allocation));
+    }
+    catch (std::exception const& error)
+    {
+        std::cerr << "RouterReplay: " << error.what() << '\n';
+        return EXIT_FAILURE;
+    }
+}
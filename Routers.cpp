@@ -1,7 +1,11 @@
 #include "Routers.hpp"
+#if defined(ROUTER_IO_URING)
+#include "UringBackend.hpp"
+#endif
 #include <boost/container_hash/hash.hpp>
 #include <boost/asio/buffer.hpp>
 #include <unordered_set>
+#include <vector>
 
 using std::begin;
 using std::end;
@@ -11,72 +15,13 @@ using std::swap;
 
 namespace Tests
 {
-    class CoPromise
+#if not defined(ROUTER_IO_URING)
+    // Without io_uring the backend is never created, but m_uring still has
+    // to be destructible.
+    class Router::Uring
     {
-    public:
-        using Signature = void(std::exception_ptr);
-
-        using AsyncResult = boost::asio::async_result<
-            std::decay_t<decltype(boost::asio::use_awaitable)>,
-            Signature
-        >;
-        using Awaitable = std::decay_t<AsyncResult::return_type>;
-        using Handler = std::decay_t<AsyncResult::handler_type>;
-
-    private:
-        std::optional<Handler> m_handler;
-        std::optional<Awaitable> m_awaitable;
-
-    public:
-        CoPromise()
-        {
-            using boost::asio::async_initiate;
-            using boost::asio::use_awaitable;
-            using Token = decltype(use_awaitable);
-
-            auto const initiation = [this](Handler&& handler) 
-            { 
-                m_handler.emplace(move(handler)); 
-            };
-            m_awaitable.emplace
-            (
-                async_initiate<Token, Signature>(initiation, use_awaitable)
-            );
-        }
-
-        ~CoPromise()
-        {
-            if (m_handler.has_value() and not m_awaitable.has_value())
-            {
-                reject(std::logic_error{ "unresolved promise" });
-            }
-        }
-
-        Awaitable getAwaitable()
-        {
-            auto awaitable = exchange(m_awaitable, std::nullopt);
-            if (not awaitable.has_value())
-            {
-                throw std::logic_error{ "copromise no state" };
-            }
-            return move(*awaitable);
-        }
-
-        void resolve()
-        {
-            throw std::runtime_error{ "not implemented" };
-        }
-
-        void reject(std::exception_ptr const& exception)
-        {
-            throw std::runtime_error{ "not implemented" };
-        }
-
-        void reject(std::exception const& exception)
-        {
-            throw std::runtime_error{ "not implemented" };
-        }
     };
+#endif
 
     Router::User::User(std::shared_ptr<Router>&& router, std::uint16_t const id)
     {
@@ -88,6 +33,11 @@ namespace Tests
         m_id = id;
     }
 
+    int Router::User::getId() const noexcept
+    {
+        return m_id;
+    }
+
     Router::Awaitable<void> Router::User::send(EndPoint const& to, std::string_view const data) const
     {
         return m_router->send(m_id, to, data);
@@ -103,22 +53,45 @@ namespace Tests
     (
         Strand strand,
         Address const& address,
-        std::unique_ptr<Nat> nat
+        std::unique_ptr<Nat> nat,
+        Backend const backend
     ) :
-        m_lastId{ 0 },
         m_strand{ move(strand) },
-        m_nat{ move(nat) }
-    {}
+        m_address{ address },
+        m_nat{ move(nat) },
+        m_lastId{ 0 }
+    {
+        if (backend == Backend::Uring)
+        {
+#if defined(ROUTER_IO_URING)
+            m_uring = std::make_unique<Uring>(*this);
+#else
+            throw std::invalid_argument{ "io_uring backend not available" };
+#endif
+        }
+    }
+
+    Router::~Router() = default;
 
     Router::User Router::createUser()
     {
         checkNat();
         m_lastId += 1;
         auto const userId = m_lastId;
-        // todo: start receive
+        m_mailboxes.try_emplace(userId, Mailbox{ {}, CoEvent{ m_strand } });
+        if (m_flowCaches.size() < userId)
+        {
+            m_flowCaches.resize(userId);
+        }
         return User{ shared_from_this(), userId };
     }
 
+    Router::Statistics Router::getStatistics() const
+    {
+        checkNat();
+        return Statistics{ m_nat->size(), m_delivered, m_filtered, m_cached, m_truncated, m_errors };
+    }
+
     Router::Awaitable<void> Router::send
     (
         std::uint16_t const port,
@@ -126,22 +99,52 @@ namespace Tests
         std::string_view const data
     )
     {
-        auto const translated = m_nat->translate(port, to);
-        auto const translatedPort = static_cast<unsigned short>(translated);
-        auto [kv, emplaced] = m_sockets.try_emplace(translated, boost::asio::executor{ m_strand });
-        auto& [key, socket] = *kv;
-        if (emplaced)
+        auto const trace = Trace::start(port, Trace::Stage::SendBegin);
+        auto const executor = co_await boost::asio::this_coro::executor;
+        co_await resumeOn(m_strand);
+        Trace::stamp(trace, port, Trace::Stage::Scheduled);
+        auto socket = static_cast<Socket*>(nullptr);
+        auto error = std::exception_ptr{};
+        try
+        {
+            socket = &route(port, to, trace);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        if (error != nullptr)
         {
-            auto const endPoint = EndPoint{ m_address, translatedPort };
-            socket.open(endPoint.protocol());
-            socket.bind(endPoint);
+            Trace::fail(trace, port);
+            co_await resumeOn(executor);
+            std::rethrow_exception(error);
         }
 
-        auto const buffer = boost::asio::buffer(data);
-        auto const bytesSent = co_await socket.async_send_to(buffer, to);
-        if (bytesSent != data.size())
+        // started on the strand; the completion comes back on executor
+        try
+        {
+            auto const buffer = boost::asio::buffer(data);
+            auto bytesSent = std::size_t{ 0 };
+#if defined(ROUTER_IO_URING)
+            if (m_uring != nullptr)
+            {
+                bytesSent = co_await m_uring->sendTo(*socket, buffer, to);
+            }
+            else
+#endif
+            {
+                bytesSent = co_await socket->async_send_to(buffer, to);
+            }
+            Trace::stamp(trace, port, Trace::Stage::Sent);
+            if (bytesSent != data.size())
+            {
+                throw std::runtime_error{ "buffer not completely sent" };
+            }
+        }
+        catch (...)
         {
-            throw std::runtime_error{ "buffer not completely sent" };
+            Trace::fail(trace, port);
+            throw;
         }
     }
 
@@ -150,9 +153,58 @@ namespace Tests
         std::uint16_t const port
     )
     {
-        boost::asio::defer([] {});
-        co_await boost::asio::defer(boost::asio::use_awaitable);
-        co_return std::pair<Router::EndPoint, std::string>{};
+        auto const executor = co_await boost::asio::this_coro::executor;
+        co_await resumeOn(m_strand);
+        auto const found = m_mailboxes.find(port);
+        if (found == cend(m_mailboxes))
+        {
+            co_await resumeOn(executor);
+            throw std::invalid_argument{ "no such user" };
+        }
+        auto& [key, mailbox] = *found;
+        auto waiter = CoWaiter{};
+        while (mailbox.packets.empty())
+        {
+            co_await mailbox.arrived.wait(waiter);
+        }
+        auto packet = move(mailbox.packets.front());
+        mailbox.packets.pop_front();
+        Trace::stamp(packet.trace, port, Trace::Stage::Woken);
+        co_await resumeOn(executor);
+        co_return std::pair{ move(packet.from), move(packet.data) };
+    }
+
+    Router::Socket& Router::route
+    (
+        std::uint16_t const port,
+        EndPoint const& to,
+        Trace::PacketId const trace
+    )
+    {
+        checkNat();
+        auto const epoch = m_nat->getEpoch();
+        auto const flow = findFlow(port, to);
+        auto socket = static_cast<Socket*>(nullptr);
+        if (flow != nullptr and flow->socket != nullptr and flow->epoch == epoch and flow->to == to)
+        {
+            // the NAT has already seen this destination, so there is no
+            // filtering state left to record
+            socket = flow->socket;
+            m_cached += 1;
+            Trace::stamp(trace, port, Trace::Stage::Translated);
+        }
+        else
+        {
+            auto const translated = m_nat->translate(port, to);
+            Trace::stamp(trace, port, Trace::Stage::Translated);
+            socket = &getSocket(translated, port);
+            if (flow != nullptr)
+            {
+                *flow = Flow{ to, socket, epoch };
+            }
+        }
+        Trace::stamp(trace, port, Trace::Stage::SocketReady);
+        return *socket;
     }
 
     Router::Socket& Router::getSocket
@@ -162,8 +214,11 @@ namespace Tests
     )
     {
         checkNat();
-        using SocketData = std::pair<Socket, std::optional<Awaitable<void>>>;
-        auto [kv, emplaced] = m_sockets.try_emplace(translated, boost::asio::executor{ m_strand });
+        // Operations are only ever started from the strand and complete on
+        // their caller's executor, so the socket itself gets the plain
+        // executor; a strand does not fit any_io_executor inline and would
+        // cost an allocation per operation.
+        auto [kv, emplaced] = m_sockets.try_emplace(translated, m_strand.get_inner_executor());
         auto& [key, socket] = *kv;
         if (emplaced)
         {
@@ -172,182 +227,192 @@ namespace Tests
                 m_address,
                 static_cast<unsigned short>(translated)
             };
-            socket.open(endPoint.protocol());
-            socket.bind(endPoint);
-            startReceive(translated, local);
+            try
+            {
+                socket.open(endPoint.protocol());
+                socket.bind(endPoint);
+                startReceive(translated, local);
+            }
+            catch (...)
+            {
+                // the next send through this translation tries again
+                m_sockets.erase(kv);
+                throw;
+            }
         }
         return socket;
     }
 
+    Router::Flow* Router::findFlow
+    (
+        std::uint16_t const local,
+        EndPoint const& to
+    )
+    {
+        if (local == 0 or local > m_flowCaches.size())
+        {
+            return nullptr;
+        }
+        auto const address = to.address();
+        auto hash = std::uint32_t{ to.port() };
+        if (address.is_v4())
+        {
+            hash ^= address.to_v4().to_uint();
+        }
+        else
+        {
+            auto const bytes = address.to_v6().to_bytes();
+            for (auto i = std::size_t{ 0 }; i < bytes.size(); i += 4)
+            {
+                hash ^= std::uint32_t{ bytes[i] } << 24 | std::uint32_t{ bytes[i + 1] } << 16
+                    | std::uint32_t{ bytes[i + 2] } << 8 | bytes[i + 3];
+            }
+        }
+        // Fibonacci hashing spreads neighbouring ports and addresses
+        auto const slot = (hash * 0x9E3779B1u) >> 29;
+        static_assert(flowCacheSize == 8, "slot takes the top three bits");
+        return &m_flowCaches[local - 1][slot];
+    }
+
     void Router::startReceive
     (
         TranslatedID const translated,
         std::uint16_t const local
     )
     {
-        /*class ReceiveHandler
-        {
-        private:
-            using Buffer = std::pair<std::string, EndPoint>;
-            std::weak_ptr<Router> m_self;
-            std::unique_ptr<Buffer> m_buffer;
-            TranslatedID m_translated;
-            std::uint16_t m_local;
-            FutureProvider<UseQueue<std::string>> m_promise;
-        public:
-
-            static Future<UseQueue<std::string>> start
-            (
-                Router& self,
-                TranslatedID const translated,
-                std::uint16_t const local
-            )
+        if (m_mailboxes.count(local) == 0)
+        {
+            throw std::logic_error{ "no such user" };
+        }
+#if defined(ROUTER_IO_URING)
+        if (m_uring != nullptr)
+        {
+            m_uring->startReceive(translated, m_sockets.at(translated));
+            return;
+        }
+#endif
+        boost::asio::co_spawn
+        (
+            m_strand,
+            receiveLoop(weak_from_this(), translated),
+            boost::asio::detached
+        );
+    }
+
+    Router::Awaitable<void> Router::receiveLoop
+    (
+        std::weak_ptr<Router> const self,
+        TranslatedID const translated
+    )
+    {
+        // one byte over the limit, so that a longer datagram shows up as
+        // filling the buffer rather than being cut silently
+        auto buffer = std::string(maxDatagram + 1, '\0');
+        auto from = EndPoint{};
+        auto failures = 0u;
+        while (true)
+        {
+            // Only borrow the socket while suspended, so that destroying the
+            // router closes it and aborts this loop instead of being kept
+            // alive by it.
+            auto socket = static_cast<Socket*>(nullptr);
+            if (auto const router = self.lock(); router != nullptr)
             {
-                auto promise = FutureProvider<UseQueue<std::string>>{};
-                auto const future = promise.getFuture();
-                auto handler = ReceiveHandler
-                {
-                    self,
-                    move(promise),
-                    translated,
-                    local
-                };
-                start(self, move(handler));
-                return future;
+                socket = &router->m_sockets.at(translated);
             }
-
-            void setResult(std::size_t bytesReceived)
+            else
             {
-                checkState();
-                auto const self = m_self.lock();
-                if (self == nullptr)
-                {
-                    return;
-                }
-
-                try
-                {
-                    self->checkNat();
-                    auto const& remote = getEndPoint();
-                    auto const id = self->m_nat->translate(m_translated, remote);
-                    if (not id.has_value())
-                    {
-                        auto promise = m_promise;
-                        try
-                        {
-                            start(*self, move(*this));
-                        }
-                        catch (...)
-                        {
-                            promise.setException(std::current_exception());
-                        }
-                        return;
-                    }
-                    if (id.value() != m_local)
-                    {
-                        throw std::logic_error{ "not implemented yet" };
-                    }
-                    auto& result = getString();
-                    result.resize(bytesReceived);
-                    m_promise.setResult(std::move(result));
-                }
-                catch (...)
-                {
-                    setException(std::current_exception());
-                }
+                co_return;
             }
 
-            void setException(std::exception_ptr const& exception)
+            auto const translatedPort = static_cast<std::uint16_t>(translated);
+            auto bytesReceived = std::size_t{ 0 };
+            auto failed = false;
+            try
             {
-                checkState();
-                m_promise.setException(std::current_exception());
+                bytesReceived = co_await socket->async_receive_from
+                (
+                    boost::asio::buffer(buffer),
+                    from
+                );
             }
-
-            std::string& getString() const
+            catch (boost::system::system_error const& error)
             {
-                checkState();
-                return std::get<std::string>(*m_buffer);
+                if (error.code() == boost::asio::error::operation_aborted)
+                {
+                    co_return;
+                }
+                Trace::fail(0, translatedPort);
+                failed = true;
             }
 
-            boost::asio::const_buffer getBuffer() const
+            auto const router = self.lock();
+            if (router == nullptr)
             {
-                checkState();
-                return boost::asio::buffer(getString());
+                co_return;
             }
-
-            EndPoint& getEndPoint() const
+            if (failed)
             {
-                checkState();
-                return std::get<EndPoint>(*m_buffer);
+                router->m_errors += 1;
+                failures += 1;
+                if (failures == maxReceiveFailures)
+                {
+                    co_return;
+                }
+                continue;
             }
-        private:
-            ReceiveHandler
-            (
-                Router& self,
-                FutureProvider<UseQueue<std::string>> promise,
-                TranslatedID const translated,
-                std::uint16_t const local
-            ) :
-                m_self{ self.weak_from_this() },
-                m_buffer{ std::make_unique<Buffer>() },
-                m_translated{ translated },
-                m_local{ local }
+            failures = 0;
+            if (bytesReceived > maxDatagram)
             {
-                getString().resize(512);
+                router->m_truncated += 1;
+                continue;
             }
 
-            static void start(Router& self, ReceiveHandler&& handler)
+            auto const trace = Trace::start(translatedPort, Trace::Stage::Received);
+            try
             {
-                handler.checkState();
-                auto const future = self.m_sockets.at(handler.m_translated)->async_receive_from
+                router->deliver
                 (
-                    handler.getBuffer(),
-                    handler.getEndPoint(),
-                    self.m_helper
+                    translated,
+                    from,
+                    std::string_view{ buffer.data(), bytesReceived },
+                    trace
                 );
-                future.then(move(handler));
             }
-
-            void checkState() const
-            {
-                if (m_buffer == nullptr)
-                {
-                    throw std::logic_error{ "no state" };
-                }
-            }
-
-            std::optional<FutureProvider<UseQueue<std::string>>> translate()
+            catch (...)
             {
-                checkState();
-                auto const self = m_self.lock();
-                if (self == nullptr)
-                {
-                    return std::nullopt;
-                }
-                self->checkNat();
-                auto const local =
-                    self->m_nat->translate(m_translated, getEndPoint());
-                if (not local.has_value())
-                {
-                    return std::nullopt;
-                }
-                if (local.value() != m_local)
-                {
-                    throw std::logic_error{ "not expected" };
-                }
-                return m_promise;
+                Trace::fail(trace, translatedPort);
+                router->m_errors += 1;
             }
-        };*/
+        }
+    }
 
-        /*auto [futureKv, futureSet] = m_received.try_emplace
-        (
-            local,
-            ReceiveHandler::start(*this, translated, local)
-        );
-        if (not futureSet)
+    void Router::deliver
+    (
+        TranslatedID const translated,
+        EndPoint const& from,
+        std::string_view const data,
+        Trace::PacketId const trace
+    )
+    {
+        checkNat();
+        auto const local = m_nat->translate(translated, from);
+        if (not local.has_value())
         {
-            throw std::logic_error{ "failed to save future" };
-        }*/
+            m_filtered += 1;
+            return;
+        }
+        Trace::stamp(trace, local.value(), Trace::Stage::ReverseTranslated);
+        auto const found = m_mailboxes.find(local.value());
+        if (found == cend(m_mailboxes))
+        {
+            return;
+        }
+        auto& [port, mailbox] = *found;
+        mailbox.packets.push_back(Packet{ from, std::string{ data }, trace });
+        m_delivered += 1;
+        Trace::stamp(trace, port, Trace::Stage::Delivered);
+        mailbox.arrived.notifyAll();
     }
 
     void Router::checkNat() const
@@ -424,8 +489,129 @@ namespace Tests
             }
             return m_nat.localFromKey(key);
         }
+
+        std::size_t size() const noexcept override
+        {
+            return m_natTable.size();
+        }
     };
 
+    // Allocates external ports in per-user blocks: port = base + block *
+    // portBlockSize + slot. The reverse direction indexes m_blocks by the
+    // port instead of keeping a second hash table.
+    template<typename T>
+    class PortBlockNatImplementation final : public Router::Nat
+    {
+    public:
+        using TranslatedID = Router::TranslatedID;
+        using EndPoint = Router::EndPoint;
+
+    private:
+        using NatTableKey = typename T::NatTableKey;
+        using Hash = typename T::Hash;
+
+        struct Block
+        {
+            std::uint16_t local;
+            std::vector<NatTableKey> keys;
+        };
+
+        static constexpr auto m_base = std::uint32_t{ 10000 };
+        static constexpr auto m_blockSize = std::uint32_t{ Router::portBlockSize };
+        static constexpr auto m_maxBlocks = ((std::uint32_t{ 1 } << 16) - m_base) / m_blockSize;
+
+    private:
+        T m_nat;
+        std::unordered_map<NatTableKey, TranslatedID, Hash> m_natTable;
+        std::vector<Block> m_blocks;
+        std::unordered_map<std::uint16_t, std::uint32_t> m_openBlocks;
+
+    private:
+        std::optional<TranslatedID> translate(std::uint16_t const local) override
+        {
+            return std::nullopt;
+        }
+
+        TranslatedID translate
+        (
+            std::uint16_t const local,
+            EndPoint const& remote
+        ) override
+        {
+            m_nat.processKeyData(local, remote);
+            auto const key = m_nat.toKey(local, remote);
+            if (auto const found = m_natTable.find(key); found != cend(m_natTable))
+            {
+                return std::get<TranslatedID>(*found);
+            }
+
+            auto [kv, opened] = m_openBlocks.try_emplace(local, 0);
+            auto& [openLocal, index] = *kv;
+            if (opened or m_blocks[index].keys.size() == m_blockSize)
+            {
+                if (m_blocks.size() >= m_maxBlocks)
+                {
+                    if (opened)
+                    {
+                        m_openBlocks.erase(kv);
+                    }
+                    throw std::overflow_error{ "Nat table exhausted" };
+                }
+                index = static_cast<std::uint32_t>(m_blocks.size());
+                m_blocks.push_back(Block{ local, {} });
+                m_blocks.back().keys.reserve(m_blockSize);
+            }
+
+            auto& block = m_blocks[index];
+            auto const port = m_base + index * m_blockSize + block.keys.size();
+            auto const translated = static_cast<TranslatedID>(port);
+            block.keys.push_back(key);
+            m_natTable.emplace(key, translated);
+            return translated;
+        }
+
+        std::optional<std::uint16_t> translate
+        (
+            TranslatedID const translated,
+            EndPoint const& remote
+        ) override
+        {
+            auto const port = static_cast<std::uint32_t>(translated);
+            if (port < m_base)
+            {
+                return std::nullopt;
+            }
+            auto const index = (port - m_base) / m_blockSize;
+            auto const slot = (port - m_base) % m_blockSize;
+            if (index >= m_blocks.size() or slot >= m_blocks[index].keys.size())
+            {
+                return std::nullopt;
+            }
+
+            auto const& key = m_blocks[index].keys[slot];
+            if (not m_nat.allowTranslate(key, remote))
+            {
+                return std::nullopt;
+            }
+            return m_nat.localFromKey(key);
+        }
+
+        std::size_t size() const noexcept override
+        {
+            return m_natTable.size();
+        }
+    };
+
+    template<typename T>
+    std::unique_ptr<Router::Nat> makeNatImplementation(Router::Allocation const allocation)
+    {
+        if (allocation == Router::Allocation::PortBlock)
+        {
+            return std::make_unique<PortBlockNatImplementation<T>>();
+        }
+        return std::make_unique<NatImplementation<T>>();
+    }
+
     template<typename T>
     class ConeNat
     {
@@ -539,6 +725,11 @@ namespace Tests
         {
             return static_cast<std::uint16_t>(translated);
         }
+
+        std::size_t size() const noexcept override
+        {
+            return 0;
+        }
     };
 
     class Router::FullCone
@@ -598,40 +789,42 @@ namespace Tests
             return std::get<std::uint16_t>(key);
         }
 
-        bool allowTranslate(NatTableKey const&, EndPoint const&) const
+        // every mapping belongs to one remote endpoint, and only that
+        // endpoint may answer through it (RFC 3489)
+        bool allowTranslate(NatTableKey const& key, EndPoint const& remote) const
         {
-            return true;
+            return std::get<EndPoint>(key) == remote;
         }
     };
 
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::NoNat>()
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::NoNat>(Allocation const)
     {
         return std::make_unique<Router::NoNat>();
     }
 
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>()
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>(Allocation const allocation)
     {
-        return std::make_unique<NatImplementation<ConeNat<FullCone>>>();
+        return makeNatImplementation<ConeNat<FullCone>>(allocation);
     }
 
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::AddressRestricted>()
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::AddressRestricted>(Allocation const allocation)
     {
-        return std::make_unique<NatImplementation<ConeNat<RestrictedNat<AddressRestricted>>>>();
+        return makeNatImplementation<ConeNat<RestrictedNat<AddressRestricted>>>(allocation);
     }
 
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::PortRestricted>()
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::PortRestricted>(Allocation const allocation)
     {
-        return std::make_unique<NatImplementation<ConeNat<RestrictedNat<PortRestricted>>>>();
+        return makeNatImplementation<ConeNat<RestrictedNat<PortRestricted>>>(allocation);
     }
 
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::Symmetric>()
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::Symmetric>(Allocation const allocation)
     {
-        return std::make_unique<NatImplementation<Symmetric>>();
+        return makeNatImplementation<Symmetric>(allocation);
     }
 
 }
\ No newline at end of file
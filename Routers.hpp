@@ -1,18 +1,23 @@
 
 #pragma once
+#include "CoPromise.hpp"
+#include "PacketTrace.hpp"
 #include <boost/asio.hpp>
+#include <array>
+#include <deque>
 #include <optional>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace Tests
 {
-    class Router : std::enable_shared_from_this<Router>
+    class Router : public std::enable_shared_from_this<Router>
     {
     public:
         template<typename T>
         using Awaitable = boost::asio::awaitable<T>;
-        using Strand = boost::asio::strand<boost::asio::executor>;
+        using Strand = boost::asio::strand<boost::asio::any_io_executor>;
         using UDP = boost::asio::ip::udp;
         using Socket = boost::asio::use_awaitable_t<>::as_default_on_t<UDP::socket>;
         using Address = boost::asio::ip::address;
@@ -23,6 +28,39 @@ namespace Tests
         enum class TranslatedID : std::uint16_t {};
         class Nat;
 
+        // Socket backend of a router; Uring needs Linux with io_uring.
+        enum class Backend
+        {
+            Reactor,
+            Uring,
+        };
+
+        // How a NAT hands out external ports. PortBlock gives every local
+        // user contiguous blocks of portBlockSize ports (RFC 7422), so inbound
+        // lookup is arithmetic on the port instead of a hash probe.
+        enum class Allocation
+        {
+            Sequential,
+            PortBlock,
+        };
+        static constexpr std::uint16_t portBlockSize = 64;
+
+        struct Statistics
+        {
+            std::size_t mappings;
+            std::size_t delivered;
+            std::size_t filtered;
+            // sends resolved by the flow cache without asking the NAT
+            std::size_t cached;
+            // inbound datagrams dropped for being longer than maxDatagram
+            std::size_t truncated;
+            // failed receives and deliveries, on either backend
+            std::size_t errors;
+        };
+
+        // Longest datagram a router forwards, on either backend.
+        static constexpr std::size_t maxDatagram = 2048;
+
         class NoNat;
         class FullCone;
         class AddressRestricted;
@@ -30,26 +68,77 @@ namespace Tests
         class Symmetric;
 
     private:
+        class Uring;
+
+        struct Packet
+        {
+            EndPoint from;
+            std::string data;
+            Trace::PacketId trace;
+        };
+
+        struct Mailbox
+        {
+            std::deque<Packet> packets;
+            CoEvent arrived;
+        };
+
+        // A user's recently resolved destinations, direct-mapped on the
+        // destination. A hit goes straight to the socket without touching
+        // the NAT or socket tables; entries from an older NAT epoch are
+        // misses.
+        struct Flow
+        {
+            EndPoint to;
+            Socket* socket = nullptr;
+            std::uint32_t epoch = 0;
+        };
+        static constexpr std::size_t flowCacheSize = 8;
+        using FlowCache = std::array<Flow, flowCacheSize>;
+
+        // Receive and delivery errors are traced and counted, never thrown
+        // out of io_context::run; a socket whose receives fail this many
+        // times in a row stops receiving instead of spinning.
+        static constexpr unsigned maxReceiveFailures = 8;
+
         Strand m_strand;
         Address m_address;
         std::unordered_map<TranslatedID, Socket> m_sockets;
+        std::unordered_map<std::uint16_t, Mailbox> m_mailboxes;
+        std::vector<FlowCache> m_flowCaches;
         std::unique_ptr<Nat> m_nat;
+        std::unique_ptr<Uring> m_uring;
         std::uint16_t m_lastId;
+        std::size_t m_delivered = 0;
+        std::size_t m_filtered = 0;
+        std::size_t m_cached = 0;
+        std::size_t m_truncated = 0;
+        std::size_t m_errors = 0;
 
     public:
         template<typename T>
         static std::shared_ptr<Router> create
         (
             Strand strand,
-            Address const& address
+            Address const& address,
+            Backend const backend = Backend::Reactor,
+            Allocation const allocation = Allocation::Sequential
         );
         Router
         (
             Strand strand,
             Address const& address,
-            std::unique_ptr<Nat> m_nat
+            std::unique_ptr<Nat> m_nat,
+            Backend const backend = Backend::Reactor
         );
+        ~Router();
+        // Unlike send and receive, these run on the caller's thread; with
+        // more than one thread, call them from the strand or before traffic.
         User createUser();
+        Statistics getStatistics() const;
+        // These move the calling coroutine onto the strand while they touch
+        // the router's tables, and back onto its own executor before they
+        // return to it.
         Awaitable<void> send
         (
             std::uint16_t const port,
@@ -57,9 +146,20 @@ namespace Tests
             std::string_view const data
         );
         Awaitable<std::pair<EndPoint, std::string>> receive(std::uint16_t const port);
-    private:
+
+        // A bare NAT table of policy T, for driving it without sockets.
         template<typename T>
-        static std::unique_ptr<Nat> makeNat();
+        static std::unique_ptr<Nat> makeNat(Allocation const allocation) = delete;
+
+    private:
+        // Picks the socket a send to `to` leaves through, translating it if
+        // the flow cache misses. Runs on m_strand.
+        Socket& route
+        (
+            std::uint16_t const port,
+            EndPoint const& to,
+            Trace::PacketId const trace
+        );
 
         Socket& getSocket
         (
@@ -67,12 +167,32 @@ namespace Tests
             std::uint16_t const local
         );
 
+        Flow* findFlow
+        (
+            std::uint16_t const local,
+            EndPoint const& to
+        );
+
         void startReceive
         (
             TranslatedID const translated,
             std::uint16_t const local
         );
 
+        static Awaitable<void> receiveLoop
+        (
+            std::weak_ptr<Router> const self,
+            TranslatedID const translated
+        );
+
+        void deliver
+        (
+            TranslatedID const translated,
+            EndPoint const& from,
+            std::string_view const data,
+            Trace::PacketId const trace
+        );
+
         void checkNat() const;
     };
 
@@ -104,42 +224,57 @@ namespace Tests
             TranslatedID const translated,
             EndPoint const& remote
         ) = 0;
+        virtual std::size_t size() const noexcept = 0;
+
+        // Changes whenever a mapping goes away, so anything that remembered
+        // a translation has to resolve it again. Mappings never expire yet;
+        // invalidate is there for a NAT that times them out.
+        std::uint32_t getEpoch() const noexcept
+        {
+            return m_epoch;
+        }
+
+    protected:
+        void invalidate() noexcept
+        {
+            m_epoch += 1;
+        }
+
+    private:
+        std::uint32_t m_epoch = 0;
     };
 
     template<typename T>
-    static std::shared_ptr<Router> Router::create
+    std::shared_ptr<Router> Router::create
     (
         Strand strand,
-        Address const& address
+        Address const& address,
+        Backend const backend,
+        Allocation const allocation
     )
     {
         return std::make_shared<Router>
         (
             std::move(strand),
             address,
-            makeNat<T>()
+            makeNat<T>(allocation),
+            backend
         );
     }
 
-    template<typename T>
-    std::unique_ptr<Router::Nat> Router::makeNat()
-    {
-        static_assert(false, "Invalid type");
-    }
-
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::NoNat>();
-    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::NoNat>();
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::NoNat>(Allocation const allocation);
+    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::NoNat>(Allocation const allocation);
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>();
-    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>();
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>(Allocation const allocation);
+    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>(Allocation const allocation);
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::AddressRestricted>();
-    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::FullCone>();
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::AddressRestricted>(Allocation const allocation);
+    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::AddressRestricted>(Allocation const allocation);
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::PortRestricted>();
-    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::PortRestricted>();
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::PortRestricted>(Allocation const allocation);
+    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::PortRestricted>(Allocation const allocation);
     template<>
-    std::unique_ptr<Router::Nat> Router::makeNat<Router::Symmetric>();
-    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::Symmetric>();
+    std::unique_ptr<Router::Nat> Router::makeNat<Router::Symmetric>(Allocation const allocation);
+    extern template std::unique_ptr<Router::Nat> Router::makeNat<Router::Symmetric>(Allocation const allocation);
 }
\ No newline at end of file
@@ -1,10 +1,46 @@
+#include "Replay.hpp"
 #include "Routers.hpp"
 #define BOOST_TEST_MODULE RouterTests
 #include <boost/test/included/unit_test.hpp>
+#include "TestSupport.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#if defined(__unix__)
+#include <sys/resource.h>
+#endif
 
 
 using namespace boost::asio;
 using namespace Tests;
+
+// Every allocation through the global operator new is counted, so tests can
+// check that steady-state paths stay off the heap.
+std::atomic<std::size_t> allocationCount{ 0 };
+
+void* operator new(std::size_t const size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (auto const memory = std::malloc(size == 0 ? 1 : size))
+    {
+        return memory;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* const memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* const memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
 awaitable<void> test()
 {
     auto executor = co_await this_coro::executor;
@@ -19,14 +55,678 @@ awaitable<void> test()
     auto userC = router2->createUser();
     auto userD = router2->createUser();
 
-    co_await userA.send(Router::EndPoint{ address1, static_cast<unsigned short>(userC.getId()) }, "test");
+    // full cone mappings start at 10100, so C's first send opens that port
+    auto const mapped = static_cast<unsigned short>(10100);
+    co_await userC.send(Router::EndPoint{ address1, mapped }, "punch");
+    co_await userA.send(Router::EndPoint{ address2, mapped }, "test");
     auto [from, data] = co_await userC.receive();
+    BOOST_CHECK_EQUAL(data, "test");
+    BOOST_CHECK(from.address() == address1);
+}
+
+awaitable<void> testUring()
+{
+    auto executor = co_await this_coro::executor;
+    auto const address1 = ip::make_address("127.0.0.4");
+    auto const address2 = ip::make_address("127.0.0.5");
+    auto const router1 = Router::create<Router::PortRestricted>(make_strand(executor), address1, Router::Backend::Uring);
+    auto const router2 = Router::create<Router::FullCone>(make_strand(executor), address2, Router::Backend::Uring);
+
+    auto userA = router1->createUser();
+    auto userC = router2->createUser();
+
+    auto const mapped = static_cast<unsigned short>(10100);
+    co_await userC.send(Router::EndPoint{ address1, mapped }, "punch");
+    for (auto i = 0; i < 8; ++i)
+    {
+        co_await userA.send(Router::EndPoint{ address2, mapped }, "test" + std::to_string(i));
+    }
+    for (auto i = 0; i < 8; ++i)
+    {
+        auto [from, data] = co_await userC.receive();
+        BOOST_CHECK_EQUAL(data, "test" + std::to_string(i));
+        BOOST_CHECK(from == Router::EndPoint(address1, mapped));
+    }
+
+    co_await userC.send(Router::EndPoint{ address1, mapped }, "reply");
+    auto [from, data] = co_await userA.receive();
+    BOOST_CHECK_EQUAL(data, "reply");
+}
+
+awaitable<void> testPortBlock()
+{
+    auto executor = co_await this_coro::executor;
+    auto const address1 = ip::make_address("127.0.0.6");
+    auto const address2 = ip::make_address("127.0.0.7");
+    auto const router1 = Router::create<Router::FullCone>
+    (
+        make_strand(executor),
+        address1,
+        Router::Backend::Reactor,
+        Router::Allocation::PortBlock
+    );
+    auto const router2 = Router::create<Router::FullCone>(make_strand(executor), address2);
+
+    auto userA = router1->createUser();
+    auto userB = router1->createUser();
+    auto userC = router2->createUser();
+
+    // every user behind router1 owns its own block of ports
+    auto const mapped = static_cast<unsigned short>(10100);
+    auto const blockA = Router::EndPoint{ address1, 10000 };
+    auto const blockB = Router::EndPoint{ address1, 10000 + Router::portBlockSize };
+    co_await userC.send(blockA, "punch");
+    co_await userA.send(Router::EndPoint{ address2, mapped }, "from A");
+    co_await userB.send(Router::EndPoint{ address2, mapped }, "from B");
+
+    auto [fromA, dataA] = co_await userC.receive();
+    BOOST_CHECK_EQUAL(dataA, "from A");
+    BOOST_CHECK(fromA == blockA);
+    auto [fromB, dataB] = co_await userC.receive();
+    BOOST_CHECK_EQUAL(dataB, "from B");
+    BOOST_CHECK(fromB == blockB);
+
+    co_await userC.send(blockB, "to B");
+    co_await userC.send(blockA, "to A");
+    auto [toA, replyA] = co_await userA.receive();
+    BOOST_CHECK_EQUAL(replyA, "to A");
+    auto [toB, replyB] = co_await userB.receive();
+    BOOST_CHECK_EQUAL(replyB, "to B");
+}
+
+awaitable<void> testFlowCache()
+{
+    auto executor = co_await this_coro::executor;
+    auto const address = ip::make_address("127.0.0.12");
+    auto const peerAddress = ip::make_address("127.0.0.13");
+    auto const router = Router::create<Router::PortRestricted>(make_strand(executor), address);
+    auto const user = router->createUser();
+
+    // more peers than cache slots, so some of them evict each other
+    auto peers = std::vector<Router::Socket>{};
+    for (auto i = 0; i < 20; ++i)
+    {
+        auto& peer = peers.emplace_back(executor);
+        peer.open(ip::udp::v4());
+        peer.bind(Router::EndPoint{ peerAddress, 0 });
+    }
+
+    auto mapped = std::optional<Router::EndPoint>{};
+    auto received = std::array<char, 16>{};
+    for (auto round = 0; round < 3; ++round)
+    {
+        for (auto& peer : peers)
+        {
+            co_await user.send(peer.local_endpoint(), "ping");
+            auto from = Router::EndPoint{};
+            co_await peer.async_receive_from(buffer(received), from);
+            if (not mapped.has_value())
+            {
+                mapped = from;
+            }
+            BOOST_CHECK(from == *mapped);
+        }
+    }
+    BOOST_CHECK_EQUAL(router->getStatistics().mappings, 1);
+    auto const cached = router->getStatistics().cached;
+    BOOST_CHECK_LT(cached, 40);
+
+    // a steady destination only asks the NAT once
+    for (auto i = 0; i < 10; ++i)
+    {
+        co_await user.send(peers.front().local_endpoint(), "ping");
+        auto from = Router::EndPoint{};
+        co_await peers.front().async_receive_from(buffer(received), from);
+    }
+    BOOST_CHECK_GE(router->getStatistics().cached, cached + 9);
+
+    for (auto& peer : peers)
+    {
+        co_await peer.async_send_to(buffer(std::string_view{ "pong" }), *mapped);
+        auto [from, data] = co_await user.receive();
+        BOOST_CHECK(from == peer.local_endpoint());
+        BOOST_CHECK_EQUAL(data, "pong");
+    }
+
+    auto stranger = Router::Socket{ executor };
+    stranger.open(ip::udp::v4());
+    stranger.bind(Router::EndPoint{ peerAddress, 0 });
+    co_await stranger.async_send_to(buffer(std::string_view{ "pong" }), *mapped);
+    co_await peers.front().async_send_to(buffer(std::string_view{ "last" }), *mapped);
+    auto [from, data] = co_await user.receive();
+    BOOST_CHECK_EQUAL(data, "last");
+    BOOST_CHECK_EQUAL(router->getStatistics().filtered, 1);
+}
+
+// A datagram longer than a router forwards is dropped and counted the same
+// way on both backends, rather than cut to fit a buffer.
+awaitable<void> testOversize(Router::Backend const backend, char const* const routerAddress)
+{
+    auto executor = co_await this_coro::executor;
+    auto const address = ip::make_address(routerAddress);
+    auto const router = Router::create<Router::FullCone>(make_strand(executor), address, backend);
+    auto const user = router->createUser();
+    auto peer = Router::Socket{ executor };
+    peer.open(ip::udp::v4());
+    peer.bind(Router::EndPoint{ ip::make_address("127.0.0.13"), 0 });
+
+    co_await user.send(peer.local_endpoint(), "open");
+    auto const mapped = Router::EndPoint{ address, 10100 };
+    for (auto const size : { Router::maxDatagram + 1, Router::maxDatagram, std::size_t{ 1400 } })
+    {
+        co_await peer.async_send_to(buffer(std::string(size, 'x')), mapped);
+    }
+    auto [fromLongest, longest] = co_await user.receive();
+    BOOST_CHECK_EQUAL(longest.size(), Router::maxDatagram);
+    auto [from, data] = co_await user.receive();
+    BOOST_CHECK_EQUAL(data.size(), 1400);
+    BOOST_CHECK_EQUAL(router->getStatistics().truncated, 1);
+    BOOST_CHECK_EQUAL(router->getStatistics().delivered, 2);
+}
+
+awaitable<void> testCoPromise()
+{
+    auto promise = CoPromise<int>{};
+    auto settled = CoPromise<>{};
+    settled.resolve();
+    co_await settled.getAwaitable();
+
+    co_spawn
+    (
+        co_await this_coro::executor,
+        [&promise]() -> awaitable<void> { promise.resolve(42); co_return; },
+        detached
+    );
+    BOOST_CHECK_EQUAL(co_await promise.getAwaitable(), 42);
+
+    auto rejected = CoPromise<int>{};
+    rejected.reject(std::runtime_error{ "rejected" });
+    BOOST_CHECK_THROW(co_await rejected.getAwaitable(), std::runtime_error);
+}
+
+awaitable<void> testCoEvent()
+{
+    auto executor = co_await this_coro::executor;
+    auto event = CoEvent{ executor };
+    auto woken = 0;
+    auto const waiter = [&]() -> awaitable<void>
+    {
+        auto node = CoWaiter{};
+        co_await event.wait(node);
+        woken += 1;
+    };
+    for (auto i = 0; i < 3; ++i)
+    {
+        co_spawn(executor, waiter, detached);
+    }
+    co_await post(executor, use_awaitable);
+    BOOST_CHECK(event.hasWaiters());
+    event.notifyAll();
+    co_await post(executor, use_awaitable);
+    co_await post(executor, use_awaitable);
+    BOOST_CHECK_EQUAL(woken, 3);
+    BOOST_CHECK(not event.hasWaiters());
+}
+
+// Two coroutines hand a promise back and forth through a pair of events;
+// once asio's per-thread caches are warm, none of it allocates.
+awaitable<void> testCoAllocations()
+{
+    auto executor = co_await this_coro::executor;
+    auto ping = CoEvent{ executor };
+    auto pong = CoEvent{ executor };
+    auto pending = static_cast<CoPromise<int>*>(nullptr);
+    auto stop = false;
+    co_spawn
+    (
+        executor,
+        [&]() -> awaitable<void>
+        {
+            auto waiter = CoWaiter{};
+            while (true)
+            {
+                co_await ping.wait(waiter);
+                if (stop)
+                {
+                    co_return;
+                }
+                pending->resolve(7);
+                pong.notifyAll();
+            }
+        },
+        detached
+    );
+    co_await resumeOn(executor);
+
+    auto waiter = CoWaiter{};
+    auto before = std::size_t{ 0 };
+    for (auto i = 0; i < 272; ++i)
+    {
+        if (i == 16)
+        {
+            before = allocationCount.load();
+        }
+        auto promise = CoPromise<int>{};
+        pending = &promise;
+        ping.notifyAll();
+        co_await pong.wait(waiter);
+        BOOST_CHECK_EQUAL(co_await promise.getAwaitable(), 7);
+
+        auto settled = CoPromise<>{};
+        settled.resolve();
+        co_await settled.getAwaitable();
+    }
+    BOOST_CHECK_EQUAL(allocationCount.load() - before, 0);
+
+    stop = true;
+    ping.notifyAll();
+    co_await resumeOn(executor);
+}
+
+// A cached send should cost little more than the socket send behind it:
+// the strand hop takes no coroutine of its own.
+awaitable<void> testSendAllocations()
+{
+    auto executor = co_await this_coro::executor;
+    auto const address = ip::make_address("127.0.0.14");
+    auto const peerAddress = ip::make_address("127.0.0.15");
+    auto const router = Router::create<Router::FullCone>(make_strand(executor), address);
+    auto const user = router->createUser();
+    auto peer = Router::Socket{ executor };
+    peer.open(ip::udp::v4());
+    peer.bind(Router::EndPoint{ peerAddress, 0 });
+    auto const to = peer.local_endpoint();
+
+    auto plain = Router::Socket{ make_strand(executor) };
+    plain.open(ip::udp::v4());
+    plain.bind(Router::EndPoint{ peerAddress, 0 });
+
+    auto const rounds = 256;
+    auto const measure = [&](auto&& send) -> awaitable<std::size_t>
+    {
+        auto before = std::size_t{ 0 };
+        for (auto i = 0; i < rounds + 16; ++i)
+        {
+            if (i == 16)
+            {
+                before = allocationCount.load();
+            }
+            co_await send();
+        }
+        co_return (allocationCount.load() - before) / rounds;
+    };
+    auto const viaRouter = co_await measure([&] { return user.send(to, "ping"); });
+    auto const direct = co_await measure
+    (
+        [&]() -> awaitable<void>
+        {
+            co_await plain.async_send_to(buffer(std::string_view{ "ping" }), to, use_awaitable);
+        }
+    );
+    BOOST_TEST_MESSAGE("allocations per send: router " << viaRouter << ", socket " << direct);
+    // the send's own frame, the hop onto the strand and back, and the op
+    // allocations the hop pushes out of asio's per-thread caches
+    BOOST_CHECK_LE(viaRouter, direct + 4);
+    BOOST_CHECK_GE(router->getStatistics().cached, rounds);
+}
+
+// A little-endian raw IPv4 pcap holding one UDP datagram per entry, with a
+// TCP segment in the middle that the reader has to skip.
+std::string writeTrace
+(
+    std::string const& name,
+    std::vector<std::pair<Router::EndPoint, Router::EndPoint>> const& datagrams
+)
+{
+    auto out = std::string{};
+    auto const put32 = [&out](std::uint32_t const value)
+    {
+        out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+    };
+    auto const put16 = [&out](std::uint16_t const value)
+    {
+        out.push_back(static_cast<char>(value >> 8));
+        out.push_back(static_cast<char>(value & 0xFF));
+    };
+    auto const packet = [&](Router::EndPoint const& from, Router::EndPoint const& to, std::uint8_t const protocol, std::uint32_t const second)
+    {
+        auto const payload = std::string{ "payload" };
+        auto const length = static_cast<std::uint16_t>(20 + 8 + payload.size());
+        put32(second);
+        put32(0);
+        put32(length);
+        put32(length);
+        put16(0x4500);
+        put16(length);
+        put16(0);
+        put16(0x4000);
+        put16(static_cast<std::uint16_t>(64 << 8 | protocol));
+        put16(0);
+        put32(0);
+        put32(0);
+        auto const addresses = out.size() - 8;
+        auto const source = from.address().to_v4().to_bytes();
+        auto const destination = to.address().to_v4().to_bytes();
+        std::copy(begin(source), end(source), begin(out) + addresses);
+        std::copy(begin(destination), end(destination), begin(out) + addresses + 4);
+        put16(from.port());
+        put16(to.port());
+        put16(static_cast<std::uint16_t>(8 + payload.size()));
+        put16(0);
+        out += payload;
+    };
+
+    put32(0xA1B2C3D4);
+    put32(0x00040002);
+    put32(0);
+    put32(0);
+    put32(65535);
+    put32(101);
+    auto second = std::uint32_t{ 0 };
+    for (auto const& [from, to] : datagrams)
+    {
+        packet(from, to, 17, second++);
+        if (second == 1)
+        {
+            packet(from, to, 6, second++);
+        }
+    }
+
+    auto const path = (std::filesystem::temp_directory_path() / name).string();
+    auto file = std::ofstream{ path, std::ios::binary };
+    file << out;
+    return path;
+}
+
+void testReplay()
+{
+    auto const endPoint = [](char const* const address, unsigned short const port)
+    {
+        return Router::EndPoint{ ip::make_address(address), port };
+    };
+    auto const inside = endPoint("10.0.0.1", 5000);
+    auto const server = endPoint("8.8.8.8", 53);
+    auto const stranger = endPoint("9.9.9.9", 53);
+    auto const path = writeTrace
+    (
+        "RouterTests-replay.pcap",
+        {
+            { inside, server },
+            { server, inside },
+            { stranger, inside },
+            { server, endPoint("10.0.0.9", 5000) },
+        }
+    );
+
+    auto options = ReplayOptions{};
+    options.routerAddress = ip::make_address("127.0.0.8");
+    options.peerAddress = ip::make_address("127.0.0.9");
+
+    auto const restricted = replay<Router::PortRestricted>(path, options);
+    BOOST_CHECK_EQUAL(restricted.datagrams, 4);
+    BOOST_CHECK_EQUAL(restricted.skipped, 1);
+    BOOST_CHECK_EQUAL(restricted.outbound, 1);
+    BOOST_CHECK_EQUAL(restricted.inbound, 2);
+    BOOST_CHECK_EQUAL(restricted.unsolicited, 1);
+    BOOST_CHECK_EQUAL(restricted.users, 1);
+    BOOST_CHECK_EQUAL(restricted.peers, 2);
+    BOOST_CHECK_EQUAL(restricted.router.mappings, 1);
+    BOOST_CHECK_EQUAL(restricted.router.delivered, 1);
+    BOOST_CHECK_EQUAL(restricted.router.filtered, 1);
+
+    auto const cone = replay<Router::FullCone>(path, options, Router::Allocation::PortBlock);
+    BOOST_CHECK_EQUAL(cone.router.mappings, 1);
+    BOOST_CHECK_EQUAL(cone.router.delivered, 2);
+    BOOST_CHECK_EQUAL(cone.router.filtered, 0);
+    std::remove(path.c_str());
 }
 
 BOOST_AUTO_TEST_CASE(Test)
 {
-    
+    run(test());
+}
+
+// Skips, rather than passes, where the kernel or the build has no io_uring.
+boost::test_tools::assertion_result uringAvailable(boost::unit_test::test_unit_id)
+{
     auto context = io_context{};
-    co_spawn(context, test, detached);
-    context.run();
-}
\ No newline at end of file
+    try
+    {
+        Router::create<Router::FullCone>(make_strand(context), ip::make_address("127.0.0.4"), Router::Backend::Uring);
+    }
+    catch (std::exception const& error)
+    {
+        auto result = boost::test_tools::assertion_result{ false };
+        result.message() << "io_uring unavailable: " << error.what();
+        return result;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(UringBackend, *boost::unit_test::precondition(uringAvailable))
+{
+    run(testUring());
+}
+
+BOOST_AUTO_TEST_CASE(OversizeDatagram)
+{
+    run(testOversize(Router::Backend::Reactor, "127.0.0.18"));
+}
+
+BOOST_AUTO_TEST_CASE(UringOversizeDatagram, *boost::unit_test::precondition(uringAvailable))
+{
+    run(testOversize(Router::Backend::Uring, "127.0.0.19"));
+}
+
+BOOST_AUTO_TEST_CASE(PortBlockAllocation)
+{
+    run(testPortBlock());
+}
+
+BOOST_AUTO_TEST_CASE(FlowCache)
+{
+    run(testFlowCache());
+}
+
+BOOST_AUTO_TEST_CASE(CoPromiseResolve)
+{
+    run(testCoPromise());
+}
+
+BOOST_AUTO_TEST_CASE(CoEventNotifyAll)
+{
+    run(testCoEvent());
+}
+
+// A receive still parked when its context goes away is abandoned with it, so
+// the user it holds lets go of the router and the router's port is free.
+void testTeardown(Router::Backend const backend, char const* const routerAddress)
+{
+    auto const address = ip::make_address(routerAddress);
+    auto const mapped = Router::EndPoint{ address, 10100 };
+    auto router = std::weak_ptr<Router>{};
+    {
+        auto context = io_context{};
+        auto sent = false;
+        co_spawn
+        (
+            context,
+            [&]() -> awaitable<void>
+            {
+                auto const user = [&]
+                {
+                    auto const created = Router::create<Router::FullCone>(make_strand(context), address, backend);
+                    router = created;
+                    return created->createUser();
+                }();
+                co_await user.send(Router::EndPoint{ ip::make_address("127.0.0.17"), 9 }, "open");
+                sent = true;
+                co_await user.receive();
+            },
+            detached
+        );
+        while (not sent)
+        {
+            context.run_one();
+        }
+        context.poll();
+        BOOST_REQUIRE(not router.expired());
+        BOOST_CHECK(router.lock()->getStatistics().mappings == 1);
+    }
+    BOOST_CHECK(router.expired());
+
+    auto context = io_context{};
+    auto socket = ip::udp::socket{ context };
+    socket.open(ip::udp::v4());
+    BOOST_CHECK_NO_THROW(socket.bind(mapped));
+}
+
+BOOST_AUTO_TEST_CASE(ContextTeardown)
+{
+    testTeardown(Router::Backend::Reactor, "127.0.0.16");
+}
+
+BOOST_AUTO_TEST_CASE(UringContextTeardown, *boost::unit_test::precondition(uringAvailable))
+{
+    testTeardown(Router::Backend::Uring, "127.0.0.22");
+}
+
+BOOST_AUTO_TEST_CASE(CoAllocations)
+{
+    run(testCoAllocations());
+}
+
+BOOST_AUTO_TEST_CASE(SendAllocations)
+{
+    run(testSendAllocations());
+}
+
+BOOST_AUTO_TEST_CASE(FlightRecorderDump)
+{
+    auto const recorder = std::make_unique<Trace::FlightRecorder>();
+    recorder->record(1, 10100, Trace::Stage::SendBegin);
+    recorder->record(1, 10100, Trace::Stage::Translated);
+    recorder->record(1, 10100, Trace::Stage::Sent);
+    BOOST_CHECK_EQUAL(recorder->size(), 3);
+
+    auto out = std::ostringstream{};
+    recorder->dump(out);
+    auto const trace = out.str();
+    BOOST_CHECK(trace.find("\"traceEvents\"") != std::string::npos);
+    BOOST_CHECK(trace.find("\"name\":\"translate\",\"cat\":\"packet\"") != std::string::npos);
+    BOOST_CHECK(trace.find("\"ph\":\"X\"") != std::string::npos);
+
+    for (auto i = std::size_t{ 0 }; i < Trace::FlightRecorder::capacity; ++i)
+    {
+        recorder->record(2, 10200, Trace::Stage::Received);
+    }
+    BOOST_CHECK_EQUAL(recorder->size(), Trace::FlightRecorder::capacity);
+}
+
+boost::test_tools::assertion_result traceEnabled(boost::unit_test::test_unit_id)
+{
+    auto result = boost::test_tools::assertion_result{ Trace::enabled };
+    result.message() << "built without ROUTER_TRACE";
+    return result;
+}
+
+// One packet through two routers on a single thread leaves every router
+// stage in that thread's recorder.
+awaitable<void> testTracedRouter()
+{
+    auto executor = co_await this_coro::executor;
+    auto const address1 = ip::make_address("127.0.0.20");
+    auto const address2 = ip::make_address("127.0.0.21");
+    auto const router1 = Router::create<Router::FullCone>(make_strand(executor), address1);
+    auto const router2 = Router::create<Router::FullCone>(make_strand(executor), address2);
+    auto const userA = router1->createUser();
+    auto const userB = router2->createUser();
+
+    auto const mapped = static_cast<unsigned short>(10100);
+    co_await userB.send(Router::EndPoint{ address1, mapped }, "punch");
+    Trace::FlightRecorder::local().clear();
+    co_await userA.send(Router::EndPoint{ address2, mapped }, "traced");
+    auto [from, data] = co_await userB.receive();
+    BOOST_CHECK_EQUAL(data, "traced");
+
+    auto out = std::ostringstream{};
+    Trace::FlightRecorder::local().dump(out);
+    auto const trace = out.str();
+    for (auto const stage : { "strand", "translate", "socket", "send_to", "receive_from", "reverse_translate", "deliver", "wake" })
+    {
+        auto const event = "\"name\":\"" + std::string{ stage } + "\"";
+        BOOST_CHECK_MESSAGE(trace.find(event) != std::string::npos, "no " << stage << " stage recorded");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TracedRouter, *boost::unit_test::precondition(traceEnabled))
+{
+    run(testTracedRouter());
+}
+
+BOOST_AUTO_TEST_CASE(PcapReplay)
+{
+    testReplay();
+}
+
+#if defined(__unix__)
+// More remote peers than descriptors left: the replay finishes and counts
+// the datagrams it could not open a socket for, on its side or the router's.
+template<typename T>
+ReplayReport testDescriptorLimit(char const* const routerAddress, char const* const peerAddress)
+{
+    auto const inside = Router::EndPoint{ ip::make_address("10.0.0.1"), 5000 };
+    auto datagrams = std::vector<std::pair<Router::EndPoint, Router::EndPoint>>{};
+    for (auto i = 0; i < 48; ++i)
+    {
+        datagrams.emplace_back(inside, Router::EndPoint{ ip::make_address("8.8.8.8"), static_cast<unsigned short>(1000 + i) });
+    }
+    auto const path = writeTrace("RouterTests-replay-limit.pcap", datagrams);
+
+    auto options = ReplayOptions{};
+    options.routerAddress = ip::make_address(routerAddress);
+    options.peerAddress = ip::make_address(peerAddress);
+
+    auto const open = static_cast<rlim_t>(std::distance(std::filesystem::directory_iterator{ "/proc/self/fd" }, {}));
+    auto limit = ::rlimit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    auto lowered = limit;
+    lowered.rlim_cur = open + 16;
+    ::setrlimit(RLIMIT_NOFILE, &lowered);
+    auto report = ReplayReport{};
+    try
+    {
+        report = replay<T>(path, options);
+    }
+    catch (...)
+    {
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+        throw;
+    }
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    std::remove(path.c_str());
+
+    BOOST_CHECK_EQUAL(report.datagrams, 48);
+    BOOST_CHECK_GT(report.exhausted, 0);
+    BOOST_CHECK_GT(report.outbound, 0);
+    BOOST_CHECK_EQUAL(report.outbound + report.exhausted, 48);
+    return report;
+}
+
+// A full cone router needs one socket for the single user, so only the
+// replay's own peer sockets run out.
+BOOST_AUTO_TEST_CASE(PcapReplayDescriptorLimit)
+{
+    auto const report = testDescriptorLimit<Router::FullCone>("127.0.0.10", "127.0.0.11");
+    BOOST_CHECK_EQUAL(report.peers, report.outbound);
+}
+
+// A symmetric router opens a socket per destination, so it runs out
+// alongside the replay and a peer can be opened for a send the router drops.
+BOOST_AUTO_TEST_CASE(PcapReplayRouterDescriptorLimit)
+{
+    auto const report = testDescriptorLimit<Router::Symmetric>("127.0.0.23", "127.0.0.24");
+    BOOST_CHECK_GE(report.peers, report.outbound);
+    BOOST_TEST_MESSAGE("peers " << report.peers << " outbound " << report.outbound << " exhausted " << report.exhausted);
+}
+#endif
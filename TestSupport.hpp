@@ -0,0 +1,69 @@
+
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace Tests
+{
+    // Runs a scenario to completion on its own io_context, driven by
+    // threads threads, and rethrows anything it throws into the test case
+    // instead of dropping it. Cases that cannot run at all say so with a
+    // precondition, so they are skipped rather than passed.
+    inline void run(boost::asio::awaitable<void> scenario, int const threads = 1)
+    {
+        auto context = boost::asio::io_context{ threads };
+        auto done = std::atomic<bool>{ false };
+        boost::asio::co_spawn
+        (
+            context,
+            std::move(scenario),
+            [&done](std::exception_ptr const error)
+            {
+                done = true;
+                if (error != nullptr)
+                {
+                    std::rethrow_exception(error);
+                }
+            }
+        );
+        auto failure = std::exception_ptr{};
+        auto failed = std::atomic<bool>{ false };
+        auto const drive = [&context, &failure, &failed]
+        {
+            try
+            {
+                context.run_for(std::chrono::seconds{ 30 });
+            }
+            catch (...)
+            {
+                // the first failure stops the other threads
+                if (not failed.exchange(true))
+                {
+                    failure = std::current_exception();
+                }
+                context.stop();
+            }
+        };
+        auto helpers = std::vector<std::thread>{};
+        for (auto i = 1; i < threads; ++i)
+        {
+            helpers.emplace_back(drive);
+        }
+        drive();
+        for (auto& helper : helpers)
+        {
+            helper.join();
+        }
+
+        if (failure != nullptr)
+        {
+            std::rethrow_exception(failure);
+        }
+        BOOST_REQUIRE_MESSAGE(done, "scenario timed out");
+    }
+}
@@ -0,0 +1,744 @@
+#include "UringBackend.hpp"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+using std::move;
+
+namespace Tests
+{
+    namespace
+    {
+        constexpr auto receiverTag = std::uint64_t{ 1 };
+        constexpr auto probeReceive = std::uint64_t{ 2 };
+        constexpr auto probeCancel = std::uint64_t{ 4 };
+        constexpr auto drainCancel = std::uint64_t{ 6 };
+
+        // sends carry their SendOperation, anything else a tag below 8
+        bool isSend(std::uint64_t const userData)
+        {
+            return userData != 0 and (userData & 7) == 0;
+        }
+
+        [[noreturn]] void throwErrno(char const* const what)
+        {
+            auto const code = boost::system::error_code
+            {
+                errno,
+                boost::system::system_category()
+            };
+            throw boost::system::system_error{ code, what };
+        }
+
+        int uringSetup(unsigned const entries, ::io_uring_params& params)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        }
+
+        int uringEnter(int const fd, unsigned const toSubmit, unsigned const toWait = 0)
+        {
+            auto const flags = toWait > 0 ? IORING_ENTER_GETEVENTS : 0u;
+            return static_cast<int>
+            (
+                ::syscall(__NR_io_uring_enter, fd, toSubmit, toWait, flags, nullptr, 0)
+            );
+        }
+
+        int uringRegister(int const fd, unsigned const opcode, void* const argument, unsigned const count)
+        {
+            return static_cast<int>
+            (
+                ::syscall(__NR_io_uring_register, fd, opcode, argument, count)
+            );
+        }
+
+        template<typename T>
+        T loadAcquire(T* const value)
+        {
+            return std::atomic_ref<T>{ *value }.load(std::memory_order_acquire);
+        }
+
+        template<typename T>
+        void storeRelease(T* const value, T const newValue)
+        {
+            std::atomic_ref<T>{ *value }.store(newValue, std::memory_order_release);
+        }
+
+        void* mapRing(std::size_t const size, int const fd, off_t const offset)
+        {
+            auto const memory = ::mmap
+            (
+                nullptr,
+                size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                fd,
+                offset
+            );
+            if (memory == MAP_FAILED)
+            {
+                throwErrno("io_uring mmap");
+            }
+            return memory;
+        }
+    }
+
+    struct Router::Uring::SendOperation
+    {
+        CoWaiter waiter;
+        int fd;
+        EndPoint to;
+        ::iovec vector;
+        ::msghdr header;
+        int result;
+        SendOperation* previous;
+        SendOperation* next;
+    };
+
+    // Queue side of CoWaiter::Park: the entry is only queued once the sending
+    // coroutine is suspended, so its completion can never race the suspend.
+    struct Router::Uring::Submission
+    {
+        Uring* ring;
+        SendOperation* operation;
+
+        void push(CoWaiter&)
+        {
+            boost::asio::dispatch
+            (
+                ring->m_router.m_strand,
+                [ring = ring, operation = operation]
+                {
+                    ring->queueSend(*operation);
+                }
+            );
+        }
+    };
+
+    Router::Uring::Uring(Router& router) :
+        Registration{ router.m_strand },
+        m_router{ router },
+        m_event{ router.m_strand }
+    {
+        try
+        {
+            setupRing();
+            setupBuffers();
+            probeMultishot();
+
+            auto eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (eventFd < 0)
+            {
+                throwErrno("eventfd");
+            }
+            m_event.assign(eventFd);
+            if (uringRegister(m_fd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0)
+            {
+                throwErrno("io_uring register eventfd");
+            }
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+    }
+
+    Router::Uring::~Uring()
+    {
+        drainSends();
+        release();
+    }
+
+    Router::Awaitable<std::size_t> Router::Uring::sendTo
+    (
+        Socket& socket,
+        boost::asio::const_buffer const buffer,
+        EndPoint const& to
+    )
+    {
+        auto operation = SendOperation{};
+        operation.fd = socket.native_handle();
+        operation.to = to;
+        operation.vector.iov_base = const_cast<void*>(buffer.data());
+        operation.vector.iov_len = buffer.size();
+        operation.header.msg_name = operation.to.data();
+        operation.header.msg_namelen = static_cast<::socklen_t>(operation.to.size());
+        operation.header.msg_iov = &operation.vector;
+        operation.header.msg_iovlen = 1;
+
+        auto submission = Submission{ this, &operation };
+        co_await operation.waiter.park(submission);
+
+        if (operation.result < 0)
+        {
+            auto const code = boost::system::error_code
+            {
+                -operation.result,
+                boost::system::system_category()
+            };
+            throw boost::system::system_error{ code, "io_uring sendmsg" };
+        }
+        co_return static_cast<std::size_t>(operation.result);
+    }
+
+    void Router::Uring::startReceive(TranslatedID const translated, Socket& socket)
+    {
+        auto receiver = std::make_unique<Receiver>();
+        receiver->translated = translated;
+        receiver->fd = socket.native_handle();
+        receiver->header = ::msghdr{};
+        receiver->header.msg_namelen = sizeof(::sockaddr_in6);
+
+        auto [kv, emplaced] = m_receivers.try_emplace(translated, move(receiver));
+        if (not emplaced)
+        {
+            throw std::logic_error{ "socket already receiving" };
+        }
+        auto& [key, stored] = *kv;
+        boost::asio::dispatch
+        (
+            m_router.m_strand,
+            [this, receiver = stored.get(), self = m_router.weak_from_this()]
+            {
+                if (self.lock() != nullptr)
+                {
+                    armReceive(*receiver);
+                }
+            }
+        );
+    }
+
+    void Router::Uring::setupRing()
+    {
+        auto params = ::io_uring_params{};
+        m_fd = uringSetup(entries, params);
+        if (m_fd < 0)
+        {
+            throwErrno("io_uring setup");
+        }
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+        {
+            throw std::runtime_error{ "io_uring without single mmap is not supported" };
+        }
+
+        auto const sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        auto const cqSize = params.cq_off.cqes + params.cq_entries * sizeof(::io_uring_cqe);
+        m_ringSize = std::max<std::size_t>(sqSize, cqSize);
+        m_ringMemory = mapRing(m_ringSize, m_fd, IORING_OFF_SQ_RING);
+        m_sqesSize = params.sq_entries * sizeof(::io_uring_sqe);
+        m_sqes = static_cast<::io_uring_sqe*>(mapRing(m_sqesSize, m_fd, IORING_OFF_SQES));
+
+        auto const base = static_cast<std::byte*>(m_ringMemory);
+        auto const at = [base](std::uint32_t const offset)
+        {
+            return reinterpret_cast<unsigned*>(base + offset);
+        };
+        m_sqHead = at(params.sq_off.head);
+        m_sqTail = at(params.sq_off.tail);
+        m_sqMask = *at(params.sq_off.ring_mask);
+        m_sqArray = at(params.sq_off.array);
+        m_cqHead = at(params.cq_off.head);
+        m_cqTail = at(params.cq_off.tail);
+        m_cqMask = *at(params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<::io_uring_cqe*>(base + params.cq_off.cqes);
+
+        // entries are always consumed in order, so the indirection array is
+        // the identity
+        for (auto i = 0u; i <= m_sqMask; ++i)
+        {
+            m_sqArray[i] = i;
+        }
+    }
+
+    void Router::Uring::setupBuffers()
+    {
+        m_bufferRingSize = bufferCount * sizeof(::io_uring_buf);
+        auto const memory = ::mmap
+        (
+            nullptr,
+            m_bufferRingSize,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0
+        );
+        if (memory == MAP_FAILED)
+        {
+            throwErrno("buffer ring mmap");
+        }
+        m_bufferRing = static_cast<::io_uring_buf_ring*>(memory);
+
+        auto registration = ::io_uring_buf_reg{};
+        registration.ring_addr = reinterpret_cast<std::uintptr_t>(m_bufferRing);
+        registration.ring_entries = bufferCount;
+        registration.bgid = bufferGroup;
+        if (uringRegister(m_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+        {
+            throwErrno("io_uring register buffer ring");
+        }
+
+        m_buffers = std::make_unique<std::byte[]>(bufferCount * bufferSize);
+        for (auto id = 0u; id < bufferCount; ++id)
+        {
+            recycleBuffer(static_cast<std::uint16_t>(id));
+        }
+    }
+
+    // Kernels before 6.0 accept a RECVMSG with IORING_RECV_MULTISHOT and only
+    // fail it with -EINVAL once it runs, which would leave every socket deaf.
+    // Run one against a socket holding a datagram sent to itself, so the
+    // constructor fails instead.
+    void Router::Uring::probeMultishot()
+    {
+        auto const fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            throwErrno("io_uring probe socket");
+        }
+        try
+        {
+            auto address = ::sockaddr_in{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            auto length = static_cast<::socklen_t>(sizeof(address));
+            auto const name = reinterpret_cast<::sockaddr*>(&address);
+            if (::bind(fd, name, length) < 0 or ::getsockname(fd, name, &length) < 0)
+            {
+                throwErrno("io_uring probe bind");
+            }
+            if (::sendto(fd, "", 1, 0, name, length) < 0)
+            {
+                throwErrno("io_uring probe send");
+            }
+
+            auto header = ::msghdr{};
+            header.msg_namelen = sizeof(::sockaddr_in6);
+            auto& receive = nextSqe();
+            receive.opcode = IORING_OP_RECVMSG;
+            receive.fd = fd;
+            receive.addr = reinterpret_cast<std::uintptr_t>(&header);
+            receive.ioprio = IORING_RECV_MULTISHOT;
+            receive.flags = IOSQE_BUFFER_SELECT;
+            receive.buf_group = bufferGroup;
+            receive.user_data = probeReceive;
+            storeRelease(m_sqTail, *m_sqTail + 1);
+
+            auto cancelled = false;
+            auto receiving = true;
+            auto toSubmit = 1u;
+            while (receiving)
+            {
+                if (uringEnter(m_fd, toSubmit, 1) < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    throwErrno("io_uring probe enter");
+                }
+                toSubmit = 0;
+
+                auto head = *m_cqHead;
+                while (head != loadAcquire(m_cqTail))
+                {
+                    auto const cqe = m_cqes[head & m_cqMask];
+                    head += 1;
+                    storeRelease(m_cqHead, head);
+                    if (cqe.user_data != probeReceive)
+                    {
+                        continue;
+                    }
+                    if ((cqe.flags & IORING_CQE_F_BUFFER) != 0)
+                    {
+                        recycleBuffer(static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                    }
+                    if (cqe.res == -EINVAL and not cancelled)
+                    {
+                        throw std::runtime_error{ "io_uring multishot receive is not supported" };
+                    }
+                    if (cqe.res < 0 and cqe.res != -ECANCELED)
+                    {
+                        errno = -cqe.res;
+                        throwErrno("io_uring probe receive");
+                    }
+                    receiving = (cqe.flags & IORING_CQE_F_MORE) != 0;
+                }
+
+                if (receiving and not std::exchange(cancelled, true))
+                {
+                    auto& cancel = nextSqe();
+                    cancel.opcode = IORING_OP_ASYNC_CANCEL;
+                    cancel.addr = probeReceive;
+                    cancel.user_data = probeCancel;
+                    storeRelease(m_sqTail, *m_sqTail + 1);
+                    toSubmit = 1;
+                }
+            }
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    void Router::Uring::release() noexcept
+    {
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        if (m_sqes != nullptr)
+        {
+            ::munmap(m_sqes, m_sqesSize);
+            m_sqes = nullptr;
+        }
+        if (m_ringMemory != nullptr)
+        {
+            ::munmap(m_ringMemory, m_ringSize);
+            m_ringMemory = nullptr;
+        }
+        if (m_bufferRing != nullptr)
+        {
+            ::munmap(m_bufferRing, m_bufferRingSize);
+            m_bufferRing = nullptr;
+        }
+    }
+
+    ::io_uring_sqe& Router::Uring::nextSqe()
+    {
+        auto const tail = *m_sqTail;
+        if (tail - loadAcquire(m_sqHead) > m_sqMask)
+        {
+            flush();
+        }
+        auto& sqe = m_sqes[tail & m_sqMask];
+        std::memset(&sqe, 0, sizeof(sqe));
+        return sqe;
+    }
+
+    void Router::Uring::pushSqe()
+    {
+        storeRelease(m_sqTail, *m_sqTail + 1);
+        m_unsubmitted += 1;
+        if (not std::exchange(m_flushPending, true))
+        {
+            // everything queued during this strand turn goes in one enter
+            boost::asio::post
+            (
+                m_router.m_strand,
+                [this, self = m_router.weak_from_this()]
+                {
+                    if (self.lock() != nullptr)
+                    {
+                        flush();
+                    }
+                }
+            );
+        }
+        if (not std::exchange(m_waiting, true))
+        {
+            waitCompletions();
+        }
+    }
+
+    void Router::Uring::queueSend(SendOperation& operation)
+    {
+        auto& sqe = nextSqe();
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = operation.fd;
+        sqe.addr = reinterpret_cast<std::uintptr_t>(&operation.header);
+        sqe.user_data = reinterpret_cast<std::uintptr_t>(&operation);
+        pushSqe();
+
+        operation.previous = nullptr;
+        operation.next = m_sending;
+        if (m_sending != nullptr)
+        {
+            m_sending->previous = &operation;
+        }
+        m_sending = &operation;
+    }
+
+    void Router::Uring::unlinkSend(SendOperation& operation) noexcept
+    {
+        if (operation.previous != nullptr)
+        {
+            operation.previous->next = operation.next;
+        }
+        else
+        {
+            m_sending = operation.next;
+        }
+        if (operation.next != nullptr)
+        {
+            operation.next->previous = operation.previous;
+        }
+        operation.previous = nullptr;
+        operation.next = nullptr;
+    }
+
+    // The kernel reads a queued send's msghdr and payload out of its sender's
+    // frame, so every send in flight is cancelled and waited for before its
+    // sender is resumed. Receives are left to die with the ring.
+    void Router::Uring::drainSends() noexcept
+    {
+        auto finished = static_cast<SendOperation*>(nullptr);
+        auto const finish = [&](SendOperation& operation, int const result)
+        {
+            unlinkSend(operation);
+            operation.result = result;
+            operation.next = finished;
+            finished = &operation;
+        };
+        try
+        {
+            if (m_sending != nullptr)
+            {
+                auto& cancel = nextSqe();
+                cancel.opcode = IORING_OP_ASYNC_CANCEL;
+                cancel.cancel_flags = IORING_ASYNC_CANCEL_ANY;
+                cancel.user_data = drainCancel;
+                storeRelease(m_sqTail, *m_sqTail + 1);
+                m_unsubmitted += 1;
+            }
+            while (m_sending != nullptr)
+            {
+                auto const submitted = uringEnter(m_fd, m_unsubmitted, 1);
+                if (submitted < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    break;
+                }
+                m_unsubmitted -= static_cast<unsigned>(submitted);
+                for (auto head = *m_cqHead; head != loadAcquire(m_cqTail); head = *m_cqHead)
+                {
+                    auto const cqe = m_cqes[head & m_cqMask];
+                    storeRelease(m_cqHead, head + 1);
+                    if (isSend(cqe.user_data))
+                    {
+                        finish(*reinterpret_cast<SendOperation*>(cqe.user_data), cqe.res);
+                    }
+                }
+            }
+        }
+        catch (...)
+        {
+        }
+        while (m_sending != nullptr)
+        {
+            finish(*m_sending, -ECANCELED);
+        }
+
+        // last, since a resumed sender can own the router and with it this
+        // ring
+        while (finished != nullptr)
+        {
+            std::exchange(finished, finished->next)->waiter.post();
+        }
+    }
+
+    void Router::Uring::abandonAll() noexcept
+    {
+        // the context is shutting down, so the posted resumptions are
+        // destroyed with it and the senders unwound
+        drainSends();
+    }
+
+    void Router::Uring::armReceive(Receiver& receiver)
+    {
+        auto& sqe = nextSqe();
+        sqe.opcode = IORING_OP_RECVMSG;
+        sqe.fd = receiver.fd;
+        sqe.addr = reinterpret_cast<std::uintptr_t>(&receiver.header);
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = bufferGroup;
+        sqe.user_data = reinterpret_cast<std::uintptr_t>(&receiver) | receiverTag;
+        pushSqe();
+    }
+
+    void Router::Uring::flush()
+    {
+        m_flushPending = false;
+        while (m_unsubmitted > 0)
+        {
+            auto const submitted = uringEnter(m_fd, m_unsubmitted);
+            if (submitted < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN or errno == EBUSY)
+                {
+                    // completion queue is full; drain it and try again
+                    reapCompletions();
+                    continue;
+                }
+                throwErrno("io_uring enter");
+            }
+            m_unsubmitted -= static_cast<unsigned>(submitted);
+        }
+    }
+
+    void Router::Uring::waitCompletions()
+    {
+        m_event.async_wait
+        (
+            boost::asio::posix::descriptor_base::wait_read,
+            [this, self = m_router.weak_from_this()](boost::system::error_code const& error)
+            {
+                if (error)
+                {
+                    return;
+                }
+                auto const router = self.lock();
+                if (router == nullptr)
+                {
+                    return;
+                }
+                auto counter = std::uint64_t{ 0 };
+                [[maybe_unused]] auto const cleared =
+                    ::read(m_event.native_handle(), &counter, sizeof(counter));
+                waitCompletions();
+                reapCompletions();
+            }
+        );
+    }
+
+    void Router::Uring::reapCompletions()
+    {
+        // The head is read afresh for every entry and released before the
+        // entry is handled: handling can re-arm a receive, and when the
+        // submission queue is full that flushes and reaps in a nested call.
+        for (auto head = *m_cqHead; head != loadAcquire(m_cqTail); head = *m_cqHead)
+        {
+            auto const cqe = m_cqes[head & m_cqMask];
+            storeRelease(m_cqHead, head + 1);
+
+            if ((cqe.user_data & receiverTag) != 0)
+            {
+                complete(*reinterpret_cast<Receiver*>(cqe.user_data & ~receiverTag), cqe);
+                continue;
+            }
+
+            // resumed through a post, so the sender never runs in here
+            auto& operation = *reinterpret_cast<SendOperation*>(cqe.user_data);
+            unlinkSend(operation);
+            operation.result = cqe.res;
+            operation.waiter.post();
+        }
+    }
+
+    void Router::Uring::complete(Receiver& receiver, ::io_uring_cqe const& cqe)
+    {
+        if (cqe.res < 0)
+        {
+            fail(receiver, cqe);
+            return;
+        }
+
+        receiver.failures = 0;
+        if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+        {
+            // multishot ended; re-armed before delivery, which runs user
+            // code
+            armReceive(receiver);
+        }
+        if ((cqe.flags & IORING_CQE_F_BUFFER) == 0)
+        {
+            return;
+        }
+
+        auto const id = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        auto const buffer = m_buffers.get() + id * bufferSize;
+        auto const header = reinterpret_cast<::io_uring_recvmsg_out const*>(buffer);
+        auto const name = buffer + sizeof(::io_uring_recvmsg_out);
+        auto const payload = name + receiver.header.msg_namelen + receiver.header.msg_controllen;
+        auto const available = static_cast<std::size_t>(cqe.res) - static_cast<std::size_t>(payload - buffer);
+
+        auto from = EndPoint{};
+        auto const nameLength = std::min<std::size_t>(header->namelen, receiver.header.msg_namelen);
+        std::memcpy(from.data(), name, nameLength);
+        from.resize(nameLength);
+
+        // payloadlen is the datagram's full length even when it was cut
+        if (header->payloadlen > maxDatagram or (header->flags & MSG_TRUNC) != 0)
+        {
+            m_router.m_truncated += 1;
+            recycleBuffer(id);
+            return;
+        }
+
+        auto const translatedPort = static_cast<std::uint16_t>(receiver.translated);
+        auto const trace = Trace::start(translatedPort, Trace::Stage::Received);
+        auto const data = std::string_view
+        {
+            reinterpret_cast<char const*>(payload),
+            std::min<std::size_t>(header->payloadlen, available)
+        };
+        try
+        {
+            m_router.deliver(receiver.translated, from, data, trace);
+        }
+        catch (...)
+        {
+            Trace::fail(trace, translatedPort);
+            m_router.m_errors += 1;
+        }
+        recycleBuffer(id);
+    }
+
+    void Router::Uring::fail(Receiver& receiver, ::io_uring_cqe const& cqe)
+    {
+        if (cqe.res == -ECANCELED)
+        {
+            return;
+        }
+        if (cqe.res == -ENOBUFS)
+        {
+            // the buffer ring ran dry; buffers come back as packets are
+            // delivered
+            if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+            {
+                armReceive(receiver);
+            }
+            return;
+        }
+
+        // anything else is counted; the receive is re-armed unless the
+        // socket keeps failing, which would otherwise spin
+        Trace::fail(0, static_cast<std::uint16_t>(receiver.translated));
+        m_router.m_errors += 1;
+        receiver.failures += 1;
+        if ((cqe.flags & IORING_CQE_F_MORE) == 0 and receiver.failures < maxReceiveFailures)
+        {
+            armReceive(receiver);
+        }
+    }
+
+    void Router::Uring::recycleBuffer(std::uint16_t const id)
+    {
+        // io_uring_buf_ring::bufs is a flexible array behind an empty struct in
+        // C++, which shifts it; the ring is a plain array of io_uring_buf
+        auto const tail = m_bufferRing->tail;
+        auto const slots = reinterpret_cast<::io_uring_buf*>(m_bufferRing);
+        auto& slot = slots[tail & (bufferCount - 1)];
+        slot.addr = reinterpret_cast<std::uintptr_t>(m_buffers.get() + id * bufferSize);
+        slot.len = static_cast<std::uint32_t>(bufferSize);
+        slot.bid = id;
+        storeRelease(&m_bufferRing->tail, static_cast<std::uint16_t>(tail + 1));
+    }
+}
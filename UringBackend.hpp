@@ -0,0 +1,115 @@
+#pragma once
+#include "Routers.hpp"
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace Tests
+{
+    // io_uring socket backend of a Router. Sends are queued as SENDMSG
+    // entries and submitted together once per strand turn. Each socket has
+    // one multishot RECVMSG drawing from a ring of provided buffers, so
+    // steady-state receive needs neither readiness notifications nor
+    // syscalls. Completions are reaped in batches on the router strand,
+    // woken through an eventfd registered with the ring.
+    //
+    // Receive and delivery errors are handled as on the reactor: traced,
+    // counted and the receive re-armed up to maxReceiveFailures in a row.
+    // Sends still in flight when the ring goes away, or when its context
+    // shuts down, are cancelled and waited for before their senders are
+    // released. All ring state is touched on the router strand only.
+    class Router::Uring : private CoWaitService::Registration
+    {
+    public:
+        static constexpr unsigned entries = 256;
+        static constexpr unsigned bufferCount = 256;
+        // room for the recvmsg header, the source address and a datagram
+        // one byte longer than the router forwards
+        static constexpr std::size_t bufferSize = 4096;
+        static_assert
+        (
+            bufferSize > sizeof(::io_uring_recvmsg_out) + sizeof(::sockaddr_in6) + maxDatagram,
+            "receive buffers cannot tell an oversized datagram"
+        );
+        static constexpr std::uint16_t bufferGroup = 0;
+
+    private:
+        struct SendOperation;
+        struct Submission;
+
+        struct Receiver
+        {
+            TranslatedID translated;
+            int fd;
+            ::msghdr header;
+            unsigned failures;
+        };
+
+        Router& m_router;
+        int m_fd = -1;
+        void* m_ringMemory = nullptr;
+        std::size_t m_ringSize = 0;
+        ::io_uring_sqe* m_sqes = nullptr;
+        std::size_t m_sqesSize = 0;
+
+        unsigned* m_sqHead = nullptr;
+        unsigned* m_sqTail = nullptr;
+        unsigned m_sqMask = 0;
+        unsigned* m_sqArray = nullptr;
+        unsigned* m_cqHead = nullptr;
+        unsigned* m_cqTail = nullptr;
+        unsigned m_cqMask = 0;
+        ::io_uring_cqe* m_cqes = nullptr;
+
+        ::io_uring_buf_ring* m_bufferRing = nullptr;
+        std::size_t m_bufferRingSize = 0;
+        std::unique_ptr<std::byte[]> m_buffers;
+
+        boost::asio::posix::stream_descriptor m_event;
+        unsigned m_unsubmitted = 0;
+        bool m_flushPending = false;
+        bool m_waiting = false;
+        std::unordered_map<TranslatedID, std::unique_ptr<Receiver>> m_receivers;
+        SendOperation* m_sending = nullptr;
+
+    public:
+        explicit Uring(Router& router);
+        Uring(Uring const&) = delete;
+        Uring& operator=(Uring const&) = delete;
+        ~Uring();
+
+        Awaitable<std::size_t> sendTo
+        (
+            Socket& socket,
+            boost::asio::const_buffer const buffer,
+            EndPoint const& to
+        );
+
+        void startReceive(TranslatedID const translated, Socket& socket);
+
+    private:
+        void setupRing();
+        void setupBuffers();
+        void probeMultishot();
+        void release() noexcept;
+
+        ::io_uring_sqe& nextSqe();
+        void pushSqe();
+        void queueSend(SendOperation& operation);
+        void unlinkSend(SendOperation& operation) noexcept;
+        void drainSends() noexcept;
+        void abandonAll() noexcept override;
+        void armReceive(Receiver& receiver);
+        void flush();
+
+        void waitCompletions();
+        void reapCompletions();
+        void complete(Receiver& receiver, ::io_uring_cqe const& cqe);
+        void fail(Receiver& receiver, ::io_uring_cqe const& cqe);
+        void recycleBuffer(std::uint16_t const id);
+    };
+}